@@ -0,0 +1,482 @@
+/*
+  DB2 CLP output formatting benchmark
+
+  Generates synthetic DB2 CLP output and runs the formatter over it.
+  Reports throughput (MB/s, rows/s), peak RSS and memory allocations
+  per row.
+
+  Build: cc -O2 -pthread -o fmt_db2_bench bench/fmt_db2_bench.c
+
+  Usage: fmt_db2_bench [options] [-- formatter options]
+   e.g.  fmt_db2_bench --rows=1000000 --columns=20 -- --threads=4 1000
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+
+/*************************************************************
+ * Allocation counting
+ * Formatter is compiled into the benchmark. All its allocations
+ * go through the default allocator of the context (see
+ * fmt_malloc()), which calls the counting wrappers.
+ *************************************************************/
+static unsigned long benchAllocations = 0;
+
+static void *bench_malloc(size_t size) {
+  __atomic_fetch_add(&benchAllocations, 1, __ATOMIC_RELAXED);
+  return malloc(size);
+}
+
+static void *bench_realloc(void *pointer, size_t size) {
+  __atomic_fetch_add(&benchAllocations, 1, __ATOMIC_RELAXED);
+  return realloc(pointer, size);
+}
+
+#define malloc(size)          bench_malloc(size)
+#define realloc(pointer, size) bench_realloc(pointer, size)
+#define main                  fmt_db2_output_main
+
+#include "../fmt_db2_output.c"
+
+#undef malloc
+#undef realloc
+#undef main
+
+
+#define MAX_GENERATED_COLUMNS 1012
+#define GENERATOR_BUFFER_SIZE (1024*1024)
+
+
+struct generatorOptions {
+  long     rows;             // Rows per resultset
+  int      columns;
+  int      maxWidth;         // Max width of character columns
+  int      nullPercent;      // NULL ('-') values
+  int      emptyPercent;     // Empty character values
+  int      numericPercent;   // Right justified numeric columns
+  long     warningEvery;     // SQL warning after each N rows, 0 - no warnings
+  int      resultsets;
+  uint64_t seed;
+};
+
+
+struct benchResult {
+  double        seconds;
+  long          peakRSS;     // KB
+  unsigned long allocations;
+  int           rc;
+};
+
+
+/*************************************************************
+ * Pseudo-random numbers (xorshift64)
+ *
+ *************************************************************/
+static uint64_t randomState;
+
+static inline unsigned long next_random(unsigned long range) {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 7;
+  randomState ^= randomState << 17;
+
+  return (range == 0) ? 0 : randomState % range;
+}
+
+
+/*************************************************************
+ * Put value into the field of 'width' characters
+ *
+ *************************************************************/
+static char *put_field(char *out, const char *value, size_t length, size_t width, int rightJustified) {
+  if (rightJustified) {
+    memset(out, ' ', width - length);
+    memcpy(out + width - length, value, length);
+  } else {
+    memcpy(out, value, length);
+    memset(out + length, ' ', width - length);
+  }
+
+  return out + width;
+}
+
+
+/*************************************************************
+ * Generate DB2 CLP output
+ * Each resultset is preceded by the statement echo and is
+ * followed by 'N record(s) selected.' message, like
+ * 'db2 -tvf script.sql' does. Column widths are defined by the
+ * column types, values are usually much shorter.
+ * Returns number of generated rows
+ *************************************************************/
+long generate_output(FILE *output, const struct generatorOptions *options) {
+  size_t widths[MAX_GENERATED_COLUMNS];
+  int    numeric[MAX_GENERATED_COLUMNS];
+  static const size_t numericWidths[] = { 6, 11, 20, 31 };   // SMALLINT, INTEGER, BIGINT, DECIMAL(31)
+  char   name[32], value[64], *line, *out;
+  size_t lineSize, length;
+  long   row, rows = 0;
+  int    resultset, column;
+
+  randomState = options->seed ? options->seed : 1;
+
+  for (column = 0, lineSize = 1; column < options->columns; column++) {
+    numeric[column] = (int)next_random(100) < options->numericPercent;
+    widths[column]  = numeric[column] ? numericWidths[next_random(4)] : 1 + next_random(options->maxWidth);
+
+    length = snprintf(name, sizeof(name), "COL%d", column);
+    if (widths[column] < length)
+      widths[column] = length;
+
+    lineSize += widths[column] + 1;
+  }
+
+  if ((line = malloc(lineSize)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return -1;
+  }
+
+  for (resultset = 0; resultset < options->resultsets; resultset++) {
+    fprintf(output, "select * from benchmark_table_%d\n\n", resultset);
+
+    // Header
+    for (column = 0, out = line; column < options->columns; column++) {
+      length = snprintf(name, sizeof(name), "COL%d", column);
+      out    = put_field(out, name, length, widths[column], 0);
+      *out++ = ' ';
+    }
+    out[-1] = '\n';
+    fwrite(line, 1, out - line, output);
+
+    for (column = 0, out = line; column < options->columns; column++) {
+      memset(out, '-', widths[column]);
+      out   += widths[column];
+      *out++ = ' ';
+    }
+    out[-1] = '\n';
+    fwrite(line, 1, out - line, output);
+
+    // Rows
+    for (row = 0; row < options->rows; row++) {
+      if (options->warningEvery > 0  &&  row > 0  &&  row % options->warningEvery == 0) {
+        fprintf(output, "SQL0445W  Value \"%ld\" has been truncated.  SQLSTATE=01004\n\n", row);
+      }
+
+      for (column = 0, out = line; column < options->columns; column++) {
+        if ((int)next_random(100) < options->nullPercent) {
+          out = put_field(out, "-", 1, widths[column], numeric[column]);
+
+        } else if (numeric[column]) {
+          // Values use up to the half of the column width
+          length = 1 + next_random(widths[column]/2);
+          for (size_t digit = 0; digit < length; digit++)
+            value[digit] = '0' + next_random(10);
+          if (value[0] == '0'  &&  length > 1)
+            value[0] = '1' + next_random(9);
+          if (length < widths[column]  &&  next_random(8) == 0) {
+            memmove(value + 1, value, length++);
+            value[0] = '-';
+          }
+
+          out = put_field(out, value, length, widths[column], 1);
+
+        } else if ((int)next_random(100) < options->emptyPercent) {
+          out = put_field(out, "", 0, widths[column], 0);
+
+        } else {
+          // Values use up to the half of the column width
+          length = 1 + next_random((widths[column] + 1)/2);
+          if (length > sizeof(value))
+            length = sizeof(value);
+
+          for (size_t letter = 0; letter < length; letter++)
+            value[letter] = 'a' + next_random(26);
+
+          // Values may start with space
+          if (length > 2  &&  next_random(16) == 0)
+            value[0] = ' ';
+
+          memset(out, ' ', widths[column]);
+          memcpy(out, value, length);
+          out += widths[column];
+        }
+
+        *out++ = ' ';
+      }
+      out[-1] = '\n';
+      fwrite(line, 1, out - line, output);
+
+      rows++;
+    }
+
+    fprintf(output, "\n  %ld record(s) selected.\n\n", options->rows);
+  }
+
+  free(line);
+
+  return rows;
+}
+
+
+/*************************************************************
+ * Count lines of the input file
+ *
+ *************************************************************/
+long count_lines(int fd) {
+  char   buffer[65536];
+  ssize_t length;
+  long   lines = 0;
+
+  while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (char *pos = buffer; (pos = memchr(pos, '\n', buffer + length - pos)) != NULL; pos++)
+      lines++;
+  }
+
+  lseek(fd, 0, SEEK_SET);
+
+  return lines;
+}
+
+
+/*************************************************************
+ * Run formatter in the child process
+ * Input is read from 'inputFd' (through the pipe if 'usePipe'
+ * is set), output goes to /dev/null.
+ * Returns 0 on success, -1 on error
+ *************************************************************/
+int run_formatter(int inputFd, int usePipe, int argc, char *argv[], struct benchResult *result) {
+  struct timespec start, end;
+  struct rusage usage;
+  int    counters[2], input[2] = { -1, -1 };
+  pid_t  formatter, feeder = -1;
+  int    status;
+
+  if (pipe(counters) != 0  ||  (usePipe  &&  pipe(input) != 0)) {
+    fprintf(stderr, "Can't create pipe: %s\n", strerror(errno));
+    return -1;
+  }
+
+  lseek(inputFd, 0, SEEK_SET);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (usePipe  &&  (feeder = fork()) == 0) {
+    char buffer[65536];
+    ssize_t length;
+
+    close(input[0]);
+
+    while ((length = read(inputFd, buffer, sizeof(buffer))) > 0) {
+      if (write(input[1], buffer, length) != length)
+        break;
+    }
+
+    _exit(0);
+  }
+
+  if ((formatter = fork()) == 0) {
+    int devNull = open("/dev/null", O_WRONLY);
+
+    dup2(usePipe ? input[0] : inputFd, STDIN_FILENO);
+    dup2(devNull, STDOUT_FILENO);
+    close(counters[0]);
+    if (usePipe) {
+      close(input[0]);
+      close(input[1]);
+    }
+
+    benchAllocations = 0;
+    status = fmt_db2_output_main(argc, argv);
+
+    if (write(counters[1], &benchAllocations, sizeof(benchAllocations)) != sizeof(benchAllocations))
+      status = 255;
+
+    _exit(status);
+  }
+
+  if (usePipe) {
+    close(input[0]);
+    close(input[1]);
+  }
+  close(counters[1]);
+
+  if (formatter < 0  ||  wait4(formatter, &status, 0, &usage) != formatter) {
+    fprintf(stderr, "Can't run formatter: %s\n", strerror(errno));
+    close(counters[0]);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (feeder > 0)
+    waitpid(feeder, NULL, 0);
+
+  result->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+  result->peakRSS = usage.ru_maxrss;
+  result->rc      = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+  if (read(counters[0], &result->allocations, sizeof(result->allocations)) != sizeof(result->allocations))
+    result->allocations = 0;
+  close(counters[0]);
+
+  return 0;
+}
+
+
+void print_result(const char *title, const struct benchResult *result, off_t inputSize, long rows) {
+  printf("%-6s %8.3f s  %9.1f MB/s  %12.0f rows/s  peak RSS %8ld KB  allocations %8lu (%.6f per row)  rc %d\n",
+         title,
+         result->seconds,
+         inputSize/result->seconds/(1024*1024),
+         rows/result->seconds,
+         result->peakRSS,
+         result->allocations,
+         rows ? (double)result->allocations/rows : 0.0,
+         result->rc);
+}
+
+
+void print_bench_usage(void) {
+  fprintf(stderr, "Usage: fmt_db2_bench [options] [-- formatter options]\n"
+                  "Options:\n"
+                  "  --rows=N        rows per resultset (default 100000)\n"
+                  "  --columns=N     number of columns (default 10)\n"
+                  "  --width=N       max width of character columns (default 40)\n"
+                  "  --nulls=P       percent of NULL values (default 10)\n"
+                  "  --empty=P       percent of empty character values (default 5)\n"
+                  "  --numeric=P     percent of right justified numeric columns (default 30)\n"
+                  "  --warnings=N    SQL warning after each N rows (default 0, no warnings)\n"
+                  "  --resultsets=N  number of resultsets (default 1)\n"
+                  "  --seed=N        random seed\n"
+                  "  --runs=N        number of formatter runs (default 5)\n"
+                  "  --input=FILE    use existing DB2 CLP output instead of generated one\n"
+                  "  --pipe          feed input through the pipe instead of the file\n"
+                  "  --generate      print generated output and exit\n");
+}
+
+
+int main(int argc, char *argv[]) {
+  struct generatorOptions options = {
+    .rows = 100000, .columns = 10, .maxWidth = 40, .nullPercent = 10, .emptyPercent = 5,
+    .numericPercent = 30, .warningEvery = 0, .resultsets = 1, .seed = 1
+  };
+  struct benchResult result, best = { .seconds = 0 }, total = { .seconds = 0 };
+  char  *inputName = NULL, path[4096], *directory;
+  char  *formatterArgv[argc + 1];
+  int    formatterArgc = 1, runs = 5, usePipe = 0, generate = 0, inputFd, run, argn;
+  long   rows;
+  struct stat inputStat;
+  FILE  *input;
+
+  formatterArgv[0] = "fmt_db2_output";
+
+  for (argn = 1; argn < argc; argn++) {
+    if      (strncmp(argv[argn], "--rows=", 7) == 0)        options.rows           = atol(argv[argn] + 7);
+    else if (strncmp(argv[argn], "--columns=", 10) == 0)    options.columns        = atoi(argv[argn] + 10);
+    else if (strncmp(argv[argn], "--width=", 8) == 0)       options.maxWidth       = atoi(argv[argn] + 8);
+    else if (strncmp(argv[argn], "--nulls=", 8) == 0)       options.nullPercent    = atoi(argv[argn] + 8);
+    else if (strncmp(argv[argn], "--empty=", 8) == 0)       options.emptyPercent   = atoi(argv[argn] + 8);
+    else if (strncmp(argv[argn], "--numeric=", 10) == 0)    options.numericPercent = atoi(argv[argn] + 10);
+    else if (strncmp(argv[argn], "--warnings=", 11) == 0)   options.warningEvery   = atol(argv[argn] + 11);
+    else if (strncmp(argv[argn], "--resultsets=", 13) == 0) options.resultsets     = atoi(argv[argn] + 13);
+    else if (strncmp(argv[argn], "--seed=", 7) == 0)        options.seed           = strtoull(argv[argn] + 7, NULL, 10);
+    else if (strncmp(argv[argn], "--runs=", 7) == 0)        runs                   = atoi(argv[argn] + 7);
+    else if (strncmp(argv[argn], "--input=", 8) == 0)       inputName              = argv[argn] + 8;
+    else if (strcmp(argv[argn], "--pipe") == 0)             usePipe                = 1;
+    else if (strcmp(argv[argn], "--generate") == 0)         generate               = 1;
+    else if (strcmp(argv[argn], "--") == 0) {
+      for (argn++; argn < argc; argn++)
+        formatterArgv[formatterArgc++] = argv[argn];
+    } else {
+      print_bench_usage();
+      return 1;
+    }
+  }
+  formatterArgv[formatterArgc] = NULL;
+
+  if ( options.rows < 0  ||  options.columns < 1  ||  options.columns > MAX_GENERATED_COLUMNS  ||
+       options.maxWidth < 1  ||  options.resultsets < 1  ||  runs < 1 ) {
+    fprintf(stderr, "Wrong argument\n");
+    print_bench_usage();
+    return 2;
+  }
+
+  if (generate) {
+    return (generate_output(stdout, &options) < 0) ? 4 : 0;
+  }
+
+
+  // Prepare input file
+  if (inputName != NULL) {
+    if ((inputFd = open(inputName, O_RDONLY)) < 0) {
+      fprintf(stderr, "Can't open file %s: %s\n", inputName, strerror(errno));
+      return 2;
+    }
+
+    rows = count_lines(inputFd);
+  } else {
+    if ((directory = getenv("TMPDIR")) == NULL  ||  directory[0] == 0)
+      directory = "/tmp";
+
+    snprintf(path, sizeof(path), "%s/fmt_db2_bench.XXXXXX", directory);
+
+    if ((inputFd = mkstemp(path)) < 0  ||  (input = fdopen(dup(inputFd), "w")) == NULL) {
+      fprintf(stderr, "Can't create input file: %s\n", strerror(errno));
+      return 2;
+    }
+    unlink(path);
+
+    setvbuf(input, NULL, _IOFBF, GENERATOR_BUFFER_SIZE);
+    rows = generate_output(input, &options);
+
+    if (fclose(input) != 0  ||  rows < 0) {
+      fprintf(stderr, "Can't write input file\n");
+      return 4;
+    }
+  }
+
+  fstat(inputFd, &inputStat);
+
+  printf("Input: %lld bytes, %ld rows", (long long)inputStat.st_size, rows);
+  for (argn = 1; argn < formatterArgc; argn++)
+    printf("%s%s", (argn == 1) ? ", formatter options: " : " ", formatterArgv[argn]);
+  printf("\n");
+
+
+  // Run formatter
+  for (run = 0; run < runs; run++) {
+    char title[16];
+
+    if (run_formatter(inputFd, usePipe, formatterArgc, formatterArgv, &result) != 0)
+      return 4;
+
+    snprintf(title, sizeof(title), "#%d", run + 1);
+    print_result(title, &result, inputStat.st_size, rows);
+
+    if (run == 0  ||  result.seconds < best.seconds)
+      best = result;
+
+    total.seconds     += result.seconds;
+    total.peakRSS      = (result.peakRSS > total.peakRSS) ? result.peakRSS : total.peakRSS;
+    total.allocations  = result.allocations;
+    total.rc           = result.rc;
+  }
+
+  total.seconds /= runs;
+
+  print_result("best", &best, inputStat.st_size, rows);
+  print_result("mean", &total, inputStat.st_size, rows);
+
+  close(inputFd);
+
+  return 0;
+}
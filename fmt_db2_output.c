@@ -2,629 +2,6462 @@
   DB2 CLP output formatting 
 
   (C) Alexander Veremyev 2016
+
+  Build: cc -O2 -pthread -o fmt_db2_output fmt_db2_output.c
+  Library (see fmtdb2.h): cc -O2 -pthread -fPIC -shared -fvisibility=hidden -DFMTDB2_LIBRARY -o libfmtdb2.so fmt_db2_output.c
+  gzip input and output: add -DFMTDB2_ZLIB ... -lz
+  io_uring I/O backend (Linux 5.6+): add -DFMTDB2_URING
 */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
-
-#define INITIAL_LINE_BUFFER_SIZE 2048
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fmtdb2.h"
+
+#ifdef FMTDB2_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef FMTDB2_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define INPUT_BLOCK_SIZE (1024*1024)
+#define DEFAULT_OUTPUT_BUFFER_SIZE (1024*1024)
+#define SPILL_BUFFER_SIZE (1024*1024)
+#define MIN_SENDFILE_LENGTH (64*1024)
+#define MAPPED_CHUNK_SIZE (4*1024*1024)
+#define COLUMNAR_BATCH_ROWS 4096
+#define COLUMNAR_BATCH_SIZE (1024*1024)
+#define BATCH_DATA_SIZE (256*1024)
+#define BATCH_MAX_LINES 4096
+#define MAX_THREADS 256
+#define MIN_ANALYSIS_CHUNK_LINES 8192
 #define INITIAL_LINES_CONTAINER_SIZE 4096
-#define INITIAL_COLUMNS_CONTAINER_SIZE 1024
+#define INITIAL_COLUMNS_CONTAINER_SIZE 64
+#define PROFILE_WIDTH_BUCKETS 16
+#define MAX_LAYOUT_CACHE_ENTRIES 256
+
+#define INPUT (&context->input)
+#define OUTPUT (&context->output)
+
+
+/*************************************************************
+ * Memory allocation
+ * All allocations go through the allocator of the formatter
+ * context which is processed by the thread.
+ *************************************************************/
+static void *default_allocate(void *opaque, size_t size) {
+  return malloc(size);
+}
+
+static void *default_reallocate(void *opaque, void *pointer, size_t size) {
+  return realloc(pointer, size);
+}
+
+static void default_release(void *opaque, void *pointer) {
+  free(pointer);
+}
+
+static const struct fmtdb2_allocator defaultAllocator = { default_allocate, default_reallocate, default_release, NULL };
+
+static _Thread_local const struct fmtdb2_allocator *allocator = &defaultAllocator;
+
+
+static inline void *fmt_malloc(size_t size) {
+  return allocator->allocate(allocator->opaque, size);
+}
+
+static inline void *fmt_calloc(size_t count, size_t size) {
+  void *pointer;
+
+  if (size != 0  &&  count > SIZE_MAX/size)
+    return NULL;
 
-#define INPUT stdin
+  if ((pointer = allocator->allocate(allocator->opaque, count*size)) != NULL)
+    memset(pointer, 0, count*size);
+
+  return pointer;
+}
+
+static inline void *fmt_realloc(void *pointer, size_t size) {
+  return allocator->reallocate(allocator->opaque, pointer, size);
+}
 
+static inline void fmt_free(void *pointer) {
+  if (pointer != NULL)
+    allocator->release(allocator->opaque, pointer);
+}
 
-struct columnDescription {
+/*************************************************************
+ * Resultset columns layout
+ * Per column fields are kept in separate contiguous arrays, so
+ * per row loops touch only the fields they use. Column names
+ * are needed for the header only and are kept apart.
+ *************************************************************/
+struct columnName {
   char             name[129];
   unsigned short   nameLength;
-  char             printFormat[64];
-  size_t           offset;
-  size_t           length;
-  long             leftPad;
-  long             rightPad;
 };
 
+// Values of the column seen by the analysis (pass 1)
+struct columnProfile {
+  unsigned long      values;          // Non-empty values, NULLs included
+  unsigned long      empty;
+  unsigned long      nulls;           // Values printed as '-'
+  unsigned long      numeric;         // Values which look like numbers (--profile only)
+  unsigned long      leftAligned;     // Non-NULL values starting at the column start
+  unsigned long      rightAligned;    // Non-NULL values ending at the column end
+  size_t             minLength;       // Trimmed length of non-NULL values
+  size_t             maxLength;
+  unsigned long long totalLength;
+  unsigned long      widths[PROFILE_WIDTH_BUCKETS];  // Values by trimmed length: 1, 2-3, 4-7, ...
+};
 
-/*************************************************************
- * Get line from input
- *
- *************************************************************/
-char* getLine (FILE * f) {
-  char * buff, * _buff;
-  char * str_ptr;
-  size_t str_length, processed_length;
-  size_t buff_size;
+// Row filter (--where). Rows are filtered out before analysis and printing.
+#define FILTER_EQUAL         0   // COL=value
+#define FILTER_NOT_EQUAL     1   // COL!=value
+#define FILTER_PREFIX        2   // COL^=prefix
+#define FILTER_LESS          3   // COL<number, numeric compare
+#define FILTER_LESS_EQUAL    4   // COL<=number
+#define FILTER_GREATER       5   // COL>number
+#define FILTER_GREATER_EQUAL 6   // COL>=number
+#define FILTER_NONE          7   // Column isn't in the resultset, no row matches
+
+struct rowFilter {
+  const char        *name;            // Column name, isn't terminated
+  size_t             nameLength;
+  int                operation;
+  const char        *value;           // Compared value
+  size_t             valueLength;
+  double             number;          // Value of numeric compare
+  size_t             inputOffset;     // Column position in the input rows, set per resultset
+  size_t             inputLength;
+};
 
+#define UTF8_CELLS 1   // Rows are UTF-8 padded by display width, positions are display cells (--utf8)
+#define UTF8_ROW   2   // Layout of non-ASCII row, positions are bytes of the row (see utf8_row_layout())
 
-  buff_size        = INITIAL_LINE_BUFFER_SIZE;
-  processed_length = 0;
-  buff             = NULL;
+// 64 input positions with separators at the bits set
+struct separatorWord {
+  size_t             position;
+  uint64_t           bits;
+};
 
+struct columnLayout {
+  long               count;           // Number of columns
+  long               size;            // Allocated entries of the arrays
+  size_t             rowLength;       // Formatted row length, set by process_header()
+  size_t             inputEnd;        // End of the last input column, rows are at least as long
+  int                passthrough;     // Output plan is equal to the input layout, rows are printed as is
+  int                reflow;          // Widen output plan for wider values (--incremental=header)
+  int                profiling;       // Collect full profile, analysis doesn't stop early (--profile)
+  int                utf8;            // See UTF8_CELLS and UTF8_ROW
+  size_t            *offset;          // Value slice. It's narrowed to the print slice by process_header()
+  size_t            *length;
+  long              *leftPad;
+  long              *rightPad;
+  size_t            *printWidth;      // Output plan: field width
+  unsigned char     *rightJustified;  // Output plan: pad value from the left
+  unsigned char     *checkOverflow;   // Values may be wider than the output plan
+  size_t            *inputOffset;     // Column position in the input rows
+  size_t            *inputLength;
+  struct columnProfile *profile;
+  struct columnName *names;
+  struct rowFilter  *filters;         // Filters of the resultset columns
+  long               filterCount;
+  struct separatorWord *separators;   // Separator positions of the columns, NULL - not built (row layouts)
+  long               separatorCount;
+  long               separatorsSize;
+};
 
-  while (1) {
-    if ( (_buff = realloc(buff, buff_size)) == NULL  ||  errno == ENOMEM ) {
-      fprintf(stderr, "Not enough memory or memory allocation error\nPartial input processing\n");
-      free(buff);
 
-      return NULL;
-    }
-    buff = _buff;
+/*************************************************************
+ * Get length of the column input slice. The last columns may
+ * be cut by the end of line.
+ *************************************************************/
+static inline size_t input_length(struct columnLayout *layout, long column, size_t length) {
+  if (layout->inputOffset[column] >= length)
+    return 0;
 
-    //  set pointer to the new string  section
-    str_ptr = buff + processed_length;
+  return (layout->inputOffset[column] + layout->inputLength[column] <= length) ?
+           layout->inputLength[column] : length - layout->inputOffset[column];
+}
 
-    // Get string and check if there was any error
-    if (fgets (str_ptr, buff_size - processed_length, f) == NULL) {
-      if (!feof(f)) {
-        // Input error
-        fprintf(stderr, "Input read error\nPartial input processing\n");
-        free(buff);
 
-        return NULL;
-      } else if (processed_length == 0) {
-        // EOF at the beginning of new line
-        free(buff);
+/*************************************************************
+ * Get value of the column without leading and trailing spaces
+ *
+ *************************************************************/
+static inline const char *trim_value(struct columnLayout *layout, long column, const char *line, size_t length, size_t *value_length) {
+  const char *value = line + layout->inputOffset[column];
+  const char *end   = value + input_length(layout, column, length);
 
-        return NULL;
-      } else {
-        // EOF at the start of new buffer section
-        return buff;
-      }
-    } else {
-      str_length = strlen(str_ptr);
+  while (value < end  &&  *value == ' ')
+    value++;
 
-      if (str_ptr[str_length - 1] == '\n') {
-        // End Of Line, string reading is done.
-        str_ptr[str_length - 1] = 0;
+  while (end > value  &&  end[-1] == ' ')
+    end--;
 
-        return buff;
-      } else {
-        processed_length += str_length;
-        buff_size *= 2;
-      }
-    }
-  }
+  *value_length = end - value;
+
+  return value;
 }
 
 
+#define INCREMENTAL_OFF       0
+#define INCREMENTAL_HEADER    1   // Widen the column and print header once again
+#define INCREMENTAL_UNALIGNED 2   // Keep the column width, print value unaligned
+
+struct processingOptions {
+  int   sampleSize;   // -1 - whole rowset is used as a sample
+  int   spill;        // Read whole rowset sample twice instead of keeping it in memory
+  int   threads;      // Number of formatter threads, 0 - single-threaded processing
+  int   stats;        // Print runtime statistics to stderr
+  int   incremental;  // Policy for values wider than the output plan in incremental mode
+  int   profile;      // Print per column profile of analyzed values to stderr
+  int   utf8;         // Input is UTF-8, columns are padded by display width
+  const char *columns;  // Comma separated names of printed columns, NULL - all columns
+  const struct rowFilter *filters;  // Row filters (--where), all of them have to match
+  int   filterCount;
+  int   layoutCache;  // Reuse column pads of the headers seen before (--layout-cache)
+  const char *layoutCachePath;  // File of the layout cache, NULL - in-process only
+  int   fixedRows;    // Rows have fixed length (--fixed-rows)
+  const char *rowIndexPath;  // Row index file, NULL - no index
+  int   compress;     // Compress output with gzip (--compress)
+  int   compressLevel;
+  int   uring;        // Read input and write output through io_uring (--io=uring)
+  int   format;       // Output format
+  const char *nullValue;  // NULL of CSV and TSV output (--null), NULL - empty field
+  int   outMode;      // Output buffer mode
+  size_t outBufferSize;
+};
+
+
 /*************************************************************
- * Load and flash input which is non-relevant to the resultset
- * printing.
+ * Runtime statistics (--stats)
+ * Phase timings are collected by process_input(), line
+ * counters are updated by the thread which reads input.
  *************************************************************/
-void flushIrrelevantLines() {
-  char * line;
+enum processingPhase {
+  PHASE_IRRELEVANT_LINES,    // flushIrrelevantLines() and find_header()
+  PHASE_GET_INPUT,
+  PHASE_PARSE_HEADER,
+  PHASE_ANALYZE_ROWSET,
+  PHASE_PROCESS_HEADER,
+  PHASE_ROWSET_PRELOADED,
+  PHASE_ROWSET,
+  PHASE_COUNT
+};
 
-  while ((line = getLine(INPUT)) != NULL) {
-    printf("%s\n", line);
+struct processingStats {
+  double        phaseTime[PHASE_COUNT];
+  unsigned long resultsets;
+  unsigned long rows;            // Rowset rows, including the filtered out ones (see print_stats())
+  unsigned long messageLines;    // SQL message lines passed through
+  unsigned long layoutCacheHits; // Resultsets formatted with cached pads
+  unsigned long unknownFilters;  // Filters of columns not found in a resultset (exit code 2)
+  unsigned long batches;         // Batches handed to the formatter threads (--threads)
+  unsigned long batchLines;
+};
 
-    if (line[0] == 0) {
-      free(line);
-      return;
-    }
+static double stats_clock(void) {
+  struct timespec now;
 
-    free(line);
-  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec/1e9;
 }
 
 
 /*************************************************************
- * Load input
+ * Block buffered line reader
+ *
+ * Input is read with read(2) in large blocks and lines are
+ * handed out as slices of the current block. Lines are not zero
+ * terminated, getLine() returns their length.
+ * A line returned by getLine() stays valid until the next call,
+ * unless the reader is in "retain" mode: then filled blocks
+ * are kept in an arena and all lines returned so far stay valid
+ * until releaseLines() frees them at once.
  *
+ * Regular files are memory mapped instead, lines are slices of
+ * the mapping and stay valid until the reader is closed.
  *************************************************************/
-char **getInput(int sample_size) {
-  char **inputLines, **_inputLines;
-  unsigned long input_buffer_size;
-  unsigned long lines, count;
+struct inputBlock {
+  struct inputBlock *next;
+  size_t             size;
+  char               data[];
+};
 
-  inputLines        = NULL;
-  input_buffer_size = INITIAL_LINES_CONTAINER_SIZE;
-  lines             = 0;
+struct lineReader {
+  int                fd;
+  int                eof;
+  int                retain;
+  struct inputBlock *block;      // Block currently being filled
+  struct inputBlock *retained;   // Filled blocks holding retained lines
+  char              *position;   // Start of not yet returned data
+  char              *end;        // End of data read so far
+  char              *map;        // Mapped input file
+  size_t             mapLength;
+  unsigned long      lines;      // Statistics: lines and bytes returned by getLine()
+  unsigned long long bytes;
+  unsigned long      growths;    // Statistics: block growths for long lines
+  ssize_t          (*source)(void *data, char *buffer, size_t size);  // Reads input instead of read(2) if set
+  void              *sourceData;
+  void             (*release)(void *data);   // Frees source data, called by closeLineReader()
+};
 
-  while (1) {
-    // Allocate/reallocate memory
-    if ( (_inputLines = realloc(inputLines, input_buffer_size*(sizeof(char *)))) == NULL  ||  errno == ENOMEM ) {
-      for (count = 0; count < lines; count++)
-        free(inputLines[ count ]);
+struct inputLine {
+  char   *data;
+  size_t  length;
+};
 
-      free (inputLines);
-      fprintf(stderr, "Not enough memory or memory allocation error\n");
+/*************************************************************
+ * Attach reader to opened file descriptor. If 'map' is set,
+ * regular files are mapped into memory, anything else (pipes,
+ * devices) is read in blocks. Reader takes ownership of the
+ * descriptor.
+ *************************************************************/
+void attachLineReader(struct lineReader *reader, int fd, int map) {
+  struct stat file_stat;
 
-      return NULL;
-    }
-    inputLines = _inputLines;
+  reader->fd = fd;
 
-    while ( lines < input_buffer_size - 1  &&  (( lines < sample_size) || (sample_size == -1)) ) {
-      if ((inputLines[lines] = getLine(INPUT)) == NULL) {
-        // End of input
-        return inputLines;
-      }
+  if (map  &&  fstat(fd, &file_stat) == 0  &&  S_ISREG(file_stat.st_mode)  &&  file_stat.st_size > 0) {
+    void *map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-      lines++;
-    }
+    if (map != MAP_FAILED) {
+      madvise(map, file_stat.st_size, MADV_SEQUENTIAL);
 
-    if (lines == sample_size) {
-      inputLines[lines] = NULL; // End of input marker
-      return inputLines;
+      reader->map       = map;
+      reader->mapLength = file_stat.st_size;
+      reader->position  = map;
+      reader->end       = reader->map + reader->mapLength;
+      reader->eof       = 1;
     }
-
-    input_buffer_size *= 2;
   }
 }
 
 
 /*************************************************************
- * Flush specified part of already preloaded lines and
- * the rest of input
- *
+ * Open input file, regular file is mapped if 'map' is set
+ * Returns 0 on success, -1 on error (errno is set)
  *************************************************************/
-void flushLines(char **lines) {
-  char * line;
+int openLineReader(struct lineReader *reader, const char *path, int map) {
+  int fd;
 
-  for (unsigned long count = 0; lines[count] != NULL; count++) {
-    printf("%s\n", lines[count]);
-    free(lines[count]);
-  }
-  free(lines);
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
 
-  while ((line = getLine(INPUT)) != NULL) {
-    printf("%s\n", line);
-    free(line);
-  }
+  attachLineReader(reader, fd, map);
+
+  return 0;
 }
 
 
 /*************************************************************
- * Get header info
+ * Allocate new input block, copying 'pending' bytes to it.
  *
  *************************************************************/
-struct columnDescription *parse_header(char *lineNames, char *lineDelimiters) {
-  int columns_buffer_size = INITIAL_COLUMNS_CONTAINER_SIZE;
-  struct columnDescription *columnsContainer, *_tempColumnsContainer;
-  long columns, count;
+static struct inputBlock *newInputBlock(size_t size, const char *pending, size_t pending_length) {
+  struct inputBlock *block;
 
-  // Allocate memory
-  if ( (columnsContainer = malloc(columns_buffer_size*sizeof(struct columnDescription))) == NULL ) {
-    fprintf(stderr, "Not enough memory or memory allocation error whileprocessing resultset header\nInitial allocation\n");
+  if ((block = fmt_malloc(sizeof(struct inputBlock) + size)) == NULL) {
     return NULL;
   }
+  block->next = NULL;
+  block->size = size;
+  if (pending_length > 0)
+    memcpy(block->data, pending, pending_length);
 
-  /***************************************************************************
-   * Parse delemeters line: '------------ -------- ------------- ---- ....'
-   *
-   ***************************************************************************/
-  columns = 0;
-  columnsContainer[columns].offset    =  0;
-  columnsContainer[columns].leftPad   = -1;
-  columnsContainer[columns].rightPad  = -1;
+  return block;
+}
 
-  for (count = 0; lineDelimiters[count] != 0; count++) {
-    switch (lineDelimiters[count]) {
-      case '-':
-        // Next char of the current column. Do nothing
-        break;
 
-      case ' ':
-        // Column break. Collect column info and skip whitespace.
-        columnsContainer[columns].length   = count - columnsContainer[columns].offset;
+/*************************************************************
+ * Make room for the next read() at the end of current block
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+static int reserveInputSpace(struct lineReader *reader) {
+  struct inputBlock *block = reader->block;
+  size_t pending_length;
 
-        columns++;
+  if (block == NULL) {
+    if ((block = newInputBlock(INPUT_BLOCK_SIZE, NULL, 0)) == NULL)
+      return -1;
 
-        // Check if it's necessary to reserve additional space for columns description container
-        if (columns + 1 >= columns_buffer_size) {
-          columns_buffer_size *= 2;
+    reader->block = block;
+    reader->position = reader->end = block->data;
+    return 0;
+  }
 
-          if ( (_tempColumnsContainer = realloc( columnsContainer, columns_buffer_size*sizeof(struct columnDescription) )) == NULL ) {
-            fprintf(stderr, "Not enough memory or memory allocation error while processing resultset header\nReallocation\n");
-            free(columnsContainer);
-            return NULL;
-          }
-          columnsContainer = _tempColumnsContainer;
-        }
+  if (reader->end < block->data + block->size) {
+    // There is still free space at the end of block
+    return 0;
+  }
 
-        columnsContainer[columns].offset   = count + 1;
-        columnsContainer[columns].leftPad  = -1;
-        columnsContainer[columns].rightPad = -1;
-        break;
+  pending_length = reader->end - reader->position;
 
-      default:
-        // Non-expected symbol. Stop processing
-        free(columnsContainer);
-        return NULL;
-    }
+  if (reader->position == block->data) {
+    // Whole block is occupied by one line. Grow the block.
+    // No line was handed out from this block, so it may be moved.
+    if ((block = fmt_realloc(block, sizeof(struct inputBlock) + block->size*2)) == NULL)
+      return -1;
+
+    block->size *= 2;
+    reader->growths++;
+  } else if (reader->retain) {
+    // Lines handed out from this block have to stay in place.
+    // Move the block to the arena and continue in a new one.
+    if ((block = newInputBlock((pending_length*2 > INPUT_BLOCK_SIZE)? pending_length*2 : INPUT_BLOCK_SIZE,
+                               reader->position, pending_length)) == NULL)
+      return -1;
+
+    reader->block->next = reader->retained;
+    reader->retained    = reader->block;
+  } else {
+    memmove(block->data, reader->position, pending_length);
   }
 
-  columnsContainer[columns].length     = count - columnsContainer[columns].offset;
-  columnsContainer[columns + 1].length = -1; // End of columns marker
+  reader->block    = block;
+  reader->position = block->data;
+  reader->end      = block->data + pending_length;
 
+  return 0;
+}
 
-  /***************************************************************************
-   * Collect column names
-   *
-   ***************************************************************************/
-  for (count = 0; columnsContainer[count].length != -1; count++) {
-    // Check header format (no zero-length columns)
-    if (columnsContainer[count].length == 0) {
-      free(columnsContainer);
 
-      return NULL;
-    }
+/*************************************************************
+ * Get line from input
+ * Returns pointer to the line and stores its length (without
+ * EOL) to 'length'. Returns NULL at the end of input.
+ *************************************************************/
+char* getLine (struct lineReader *reader, size_t *length) {
+  char    *line, *eol;
+  ssize_t  read_length;
 
-    // 128 is a limit of column name length in DB2 UDB
-    // Nevertheless, let's check it since space for name is limited by 129 characters
-    columnsContainer[count].nameLength = (columnsContainer[count].length < 128)? columnsContainer[count].length : 128;
+  while (1) {
+    if (reader->position != NULL  &&  (eol = memchr(reader->position, '\n', reader->end - reader->position)) != NULL) {
+      // End Of Line, string reading is done.
+      line = reader->position;
+      *length = eol - line;
+      reader->position = eol + 1;
 
-    strncpy(
-      columnsContainer[count].name
-     ,lineNames + columnsContainer[count].offset
-     ,columnsContainer[count].nameLength
-    );
-    columnsContainer[count].name[ columnsContainer[count].nameLength ] = 0;
+      reader->lines++;
+      reader->bytes += *length + 1;
 
-    // Remove trailing spaces from column name
-    for (short charCounter = columnsContainer[count].nameLength - 1; charCounter >= 0; charCounter--) {
-      if (columnsContainer[count].name[charCounter] == ' ') {
-        columnsContainer[count].name[charCounter] = 0;
-        columnsContainer[count].nameLength--;
-      } else {
-        break;
+      return line;
+    }
+
+    if (reader->eof) {
+      if (reader->position == reader->end) {
+        // EOF at the beginning of new line
+        return NULL;
       }
+
+      // Last line without EOL
+      line = reader->position;
+      *length = reader->end - line;
+      reader->position = reader->end;
+
+      reader->lines++;
+      reader->bytes += *length;
+
+      return line;
     }
 
-    // Check that column has correct name
-    if (columnsContainer[count].nameLength == 0) {
-      free(columnsContainer);
+    if (reserveInputSpace(reader) != 0) {
+      fprintf(stderr, "Not enough memory or memory allocation error\nPartial input processing\n");
+      reader->eof = 1;
+      reader->position = reader->end;
+
+      return NULL;
+    }
+
+    read_length = (reader->source != NULL) ?
+      reader->source(reader->sourceData, reader->end, reader->block->data + reader->block->size - reader->end) :
+      read(reader->fd, reader->end, reader->block->data + reader->block->size - reader->end);
+
+    if (read_length < 0) {
+      if (errno == EINTR)
+        continue;
+
+      // Input error
+      fprintf(stderr, "Input read error\nPartial input processing\n");
+      reader->eof = 1;
+      reader->position = reader->end;
+
       return NULL;
+    } else if (read_length == 0) {
+      reader->eof = 1;
+    } else {
+      reader->end += read_length;
     }
   }
+}
 
-  return columnsContainer;
+
+/*************************************************************
+ * Keep lines returned by getLine() valid until they are
+ * released with releaseLines()
+ *************************************************************/
+void retainLines(struct lineReader *reader) {
+  reader->retain = 1;
 }
 
 
 /*************************************************************
- * Check, that line looks like valid resultset row
- * Returns:
- *  0 - valid row
- *  1 - SQL error or warning
- * -1 - non-DB2 output
- *
+ * Give back 'lines' mapped lines starting from 'line', they are
+ * returned by getLine() once again
  *************************************************************/
-int is_valid_row(struct columnDescription *columns, char* line, int state) {
-  size_t length;
-  long   count, offset;
+void unreadLines(struct lineReader *reader, char *line, unsigned long lines) {
+  reader->bytes   -= reader->position - line;
+  reader->lines   -= lines;
+  reader->position = line;
+}
 
-  if (state == -1)  return -1;
 
-  length = strlen(line);
+/*************************************************************
+ * Get input position of the next line for rewindLineReader()
+ * Returns 0 on success, -1 if input can't be read once again
+ * (pipes, sources, retained lines)
+ *************************************************************/
+int markLineReader(struct lineReader *reader, off_t *mark) {
+  struct stat file_stat;
+  off_t offset;
 
-  for (count = 0; columns[count].length != -1; count++) {
-    offset = columns[count].offset + columns[count].length;
+  if (reader->source != NULL  ||  reader->retain)
+    return -1;
 
-    if ( offset > length  ||  (line[offset] != ' ' && line[offset] != 0) ) {
-      if (state == 1  ||  strncmp(line, "SQL", 3) == 0) {
-        // SQL error or warning
-        return 1;
-      } else {
-        return -1;
-      }
-    }
+  if (reader->map != NULL) {
+    *mark = reader->position - reader->map;
+    return 0;
   }
 
+  if (fstat(reader->fd, &file_stat) != 0  ||  !S_ISREG(file_stat.st_mode)  ||  (offset = lseek(reader->fd, 0, SEEK_CUR)) < 0)
+    return -1;
+
+  // Data after the position is already read
+  *mark = offset - (reader->end - reader->position);
+
   return 0;
 }
 
 
 /*************************************************************
- * Print rowset line.
+ * Continue reading from the marked position (see
+ * markLineReader()). Lines returned before are invalidated.
+ * Returns 0 on success, -1 on error (errno is set)
+ *************************************************************/
+int rewindLineReader(struct lineReader *reader, off_t mark) {
+  if (reader->map != NULL) {
+    reader->position = reader->map + mark;
+    return 0;
+  }
+
+  if (lseek(reader->fd, mark, SEEK_SET) != mark)
+    return -1;
+
+  if (reader->block != NULL)
+    reader->position = reader->end = reader->block->data;
+  reader->eof = 0;
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Free all retained lines at once
  *
  *************************************************************/
-void print_row(struct columnDescription *columns, char *line) {
-  long count;
+void releaseLines(struct lineReader *reader) {
+  struct inputBlock *block;
 
-  for (count = 0; columns[count].length != -1; count++) {
-    printf(columns[count].printFormat, line + columns[count].offset);
+  while ((block = reader->retained) != NULL) {
+    reader->retained = block->next;
+    fmt_free(block);
   }
 
-  free(line);
+  reader->retain = 0;
 }
 
 
 /*************************************************************
- * Analyze rowset (pass 1)
+ * Free reader buffers
  *
  *************************************************************/
-int analyze_rowset(struct columnDescription *columns, char **lines) {
-  long count, columnCount;
-  long leftPad, rightPad;
-  size_t offset, length;
+void closeLineReader(struct lineReader *reader) {
+  releaseLines(reader);
 
+  if (reader->release != NULL) {
+    reader->release(reader->sourceData);
+    reader->release = NULL;
+    reader->source  = NULL;
+  }
 
-  // Iterate through lines to get left/right padding info
-  for (count = 2; lines[count] != NULL; count++) {
-    // Check if it's the end of result set. If yes, break
-    if (lines[count][0] == 0)
-      break;
+  fmt_free(reader->block);
+  reader->block    = NULL;
+  reader->position = reader->end = NULL;
 
-    switch (is_valid_row(columns, lines[count], 0)) {
-      case 1:
-        // SQL error or warning. Skip non-relevant lines up to empty line.
-        while (lines[count] != NULL  &&  lines[count][0] != 0) {
-          count++;
-        }
+  if (reader->map != NULL) {
+    munmap(reader->map, reader->mapLength);
+    reader->map = NULL;
+  }
 
-        // Go to next input line
-        continue;
+  if (reader->fd > STDIN_FILENO) {
+    close(reader->fd);
+    reader->fd = STDIN_FILENO;
+  }
+}
 
-      case -1:
-        return -1;
-    }
 
-    for (columnCount = 0; columns[columnCount].length != -1; columnCount++) {
-      // Get left pad
-      offset  = columns[columnCount].offset;
-      length  = columns[columnCount].length;
-      leftPad = 0;
-      while (lines[count][offset + leftPad] == ' ' && leftPad < length)
-         leftPad++;
+/*************************************************************
+ * Output buffer
+ *
+ * All output is collected in one large buffer and written with
+ * write(2). In block mode the buffer is written only when it's
+ * full (pipes, files), in line mode it's written at the end of
+ * each line (interactive terminals). In memory mode the buffer
+ * grows and is never written.
+ *************************************************************/
+#define OUTPUT_MODE_AUTO   0
+#define OUTPUT_MODE_BLOCK  1
+#define OUTPUT_MODE_LINE   2
+#define OUTPUT_MODE_MEMORY 3
+
+#define OUTPUT_FORMAT_TEXT     0
+#define OUTPUT_FORMAT_COLUMNAR 1
+#define OUTPUT_FORMAT_CSV      2
+#define OUTPUT_FORMAT_TSV      3
+#define OUTPUT_FORMAT_JSONL    4
+
+#define RECORD_MESSAGE 1   // SQL message lines inside of rowset
+#define RECORD_END     2   // Line which ends rowset
+
+// Non-row lines of fixed length rowsets (--fixed-rows)
+struct outputRecord {
+  unsigned long long offset;   // Output offset (buffer offset for memory buffers)
+  size_t             length;
+  int                type;
+};
 
-      if (leftPad == columns[columnCount].length)
-        // Empty value. Don't take it into account.
-        continue;
+struct outputRecords {
+  int                  enabled;
+  struct outputRecord *items;
+  size_t               count;
+  size_t               size;
+};
 
-      if (columns[columnCount].leftPad == -1 || columns[columnCount].leftPad > leftPad)
-        columns[columnCount].leftPad = leftPad;
+struct outputBuffer {
+  int     fd;
+  int     mode;
+  int     error;
+  char   *data;
+  size_t  size;
+  size_t  used;
+  unsigned long long written;  // Data written to the file or sink
+  unsigned long      filtered; // Statistics: rows filtered out by --where
+  int     format;
+  struct outputRecords    records;    // Non-row lines (see record_output())
+  struct columnarBuilder *columnar;   // Columnar output builder
+  struct outputBuffer    *messages;   // Non-resultset lines of delimited formats
+  fmtdb2_write            sink;       // Writes output instead of write(2) if set
+  void                   *sinkData;
+  int                     stream;     // Stream of the sink
+};
 
 
-      // Get right pad
-      rightPad = 0;
-      while (lines[count][offset + length - rightPad - 1] == ' '  &&  rightPad < length)
-        rightPad++;
 
-      if (columns[columnCount].rightPad == -1  ||  columns[columnCount].rightPad > rightPad)
-        columns[columnCount].rightPad = rightPad;
-    }
-  }
+/*************************************************************
+ * Layout cache (--layout-cache)
+ * Column pads and justification of the rowsets formatted before,
+ * keyed by hash of the header lines and of the options which
+ * change the analysis. Entries are kept in the least recently
+ * used first order.
+ *************************************************************/
+struct layoutCacheEntry {
+  uint64_t       key;
+  long           count;       // Number of columns
+  long          *pads;        // Left pads followed by right pads
+  unsigned char *justified;   // Right justified columns, allocated with the pads
+};
 
-  return 0;
-}
+struct layoutCache {
+  int   loaded;               // Cache file is read
+  int   changed;              // Entries are changed since the cache file is read
+  long  count;
+  struct layoutCacheEntry entries[MAX_LAYOUT_CACHE_ENTRIES];
+};
 
 
-/**********************************************************************************
- * Process header
+/*************************************************************
+ * Formatter context
  *
- **********************************************************************************/
-void process_header(struct columnDescription *columns) {
-  struct columnDescription *column;
-  char headerPrintFormat[64];
-  long count, columnCount;
+ * All state of the formatter: input reader, output buffers and
+ * statistics. The command line tool has one context, library
+ * contexts are created by fmtdb2_create(). Each thread works
+ * for one context at a time, it's set by enter_context().
+ *************************************************************/
+struct formatterContext {
+  struct processingOptions options;
+  struct lineReader        input;
+  struct outputBuffer      output;
+  struct outputBuffer      messages;   // Non-resultset lines of delimited formats
+  struct outputBuffer      rowIndex;   // Row index of fixed length rows (--fixed-rows)
+  struct gzipOutput       *compressor; // Sink of the compressed output (--compress)
+  struct uringOutput      *uringOutput; // Sink of the output written by io_uring (--io=uring)
+  struct processingStats   stats;
+  struct layoutCache       layouts;    // Kept by fmtdb2_reset()
+  struct fmtdb2_allocator  allocator;
+
+  // Push interface (see fmtdb2_feed())
+  fmtdb2_write             write;
+  void                    *opaque;
+  struct rowFilter        *filters;
+  pthread_t                worker;
+  pthread_mutex_t          mutex;
+  pthread_cond_t           cond;
+  const char              *chunk;      // Fed data not yet read by the worker
+  size_t                   chunkLength;
+  int                      started;    // Worker is running
+  int                      waiting;    // Worker waits for the next chunk
+  int                      finished;   // End of input, set by fmtdb2_reset()
+  int                      done;       // Worker has processed whole input
+  int                      result;
+};
 
-  // Column names
-  for (count = 0; columns[count].length != -1; count++) {
-    column    = &(columns[count]);
+static _Thread_local struct formatterContext *context;
 
-    if (column->leftPad == -1) {
-      // Empty column
-      column->length = column->nameLength;
 
-      snprintf(headerPrintFormat,   64, (columns[count+1].length == -1) ? "%%-%d.%ds\n" : "%%-%d.%ds ", column->nameLength, column->nameLength);
-      snprintf(column->printFormat, 64, (columns[count+1].length == -1) ? "%%-%d.%ds\n" : "%%-%d.%ds ", column->nameLength, column->nameLength);
+static void enter_context(struct formatterContext *processed) {
+  context   = processed;
+  allocator = &processed->allocator;
+}
 
-    } else if (column->nameLength <= column->length - (column->leftPad + column->rightPad) ) {
-      // Value is longer or equal than column name
-      column->offset += column->leftPad;
-      column->length -= (column->leftPad + column->rightPad);
 
-      snprintf(headerPrintFormat,   64, (columns[count+1].length == -1) ? "%%-%d.%ds\n" : "%%-%d.%ds ", column->length, column->nameLength);
-      snprintf(column->printFormat, 64, (columns[count+1].length == -1) ? "%%-%d.%ds\n" : "%%-%d.%ds ", column->length, column->length);
+static inline void stats_phase(enum processingPhase phase, double started) {
+  context->stats.phaseTime[phase] += stats_clock() - started;
+}
 
-    } else {
-      // Name is longer than column values
-      column->offset += column->leftPad;
-      column->length -= (column->leftPad + column->rightPad);
 
-      if (column->leftPad <= column->rightPad) {
-        // Left padded column
-        snprintf(column->printFormat, 64, (columns[count+1].length == -1) ? "%%-%d.%ds\n" : "%%-%d.%ds ", column->nameLength, column->length);
-      } else {
-        // Special case, values are right justified
-        snprintf(column->printFormat, 64, (columns[count+1].length == -1) ? "%%%d.%ds\n"  : "%%%d.%ds ",  column->nameLength, column->length);
-      }
+/*************************************************************
+ * Count line processed in 'previous_state' (see process_row())
+ *
+ *************************************************************/
+static inline void stats_line(int previous_state, int state) {
+  if (previous_state == 0  &&  state == 0)
+    context->stats.rows++;
+  else if (previous_state == 1  ||  state == 1)
+    context->stats.messageLines++;
+}
 
-      sprintf(headerPrintFormat, (columns[count+1].length == -1) ? "%%-%d.%ds\n" : "%%-%d.%ds ", column->nameLength, column->nameLength);
-    }
 
-    printf(headerPrintFormat, column->name);
-  }
 
-  for (columnCount = 0; columns[columnCount].length != -1; columnCount++) {
-    size_t length;
 
-    length = (columns[columnCount].nameLength > columns[columnCount].length)?
-                   columns[columnCount].nameLength : columns[columnCount].length;
-    for (count = 0; count < length; count++) {
-      putchar('-');
-    }
+/*************************************************************
+ * Allocate output buffer
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+int openOutputBuffer(struct outputBuffer *out, size_t size, int mode) {
+  if (mode == OUTPUT_MODE_AUTO)
+    mode = isatty(out->fd) ? OUTPUT_MODE_LINE : OUTPUT_MODE_BLOCK;
 
-    if (columns[columnCount+1].length != -1)
-      printf(" ");
-  }
+  if ((out->data = fmt_malloc(size)) == NULL)
+    return -1;
 
-  printf("\n");
+  out->mode = mode;
+  out->size = size;
+  out->used = 0;
+
+  return 0;
 }
 
+
 /*************************************************************
- * Flush row
+ * Write data to output file
+ * Write errors are reported once, output is discarded after that.
+ *************************************************************/
+static void writeOutput(struct outputBuffer *out, const char *data, size_t length) {
+  size_t  written = 0;
+  ssize_t result;
+
+  out->written += length;
+
+  if (out->sink != NULL) {
+    if (!out->error  &&  length > 0  &&  out->sink(out->sinkData, out->stream, data, length) != 0)
+      out->error = 1;
+
+    return;
+  }
+
+  while (written < length  &&  !out->error) {
+    if ((result = write(out->fd, data + written, length - written)) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      fprintf(stderr, "Output write error: %s\n", strerror(errno));
+      out->error = 1;
+    } else {
+      written += result;
+    }
+  }
+}
+
+
+/*************************************************************
+ * Write buffered data
+ *
+ *************************************************************/
+void flushOutput(struct outputBuffer *out) {
+  if (out->mode == OUTPUT_MODE_MEMORY)
+    return;
+
+  writeOutput(out, out->data, out->used);
+
+  out->used = 0;
+}
+
+
+/*************************************************************
+ * Reserve space for 'length' bytes of output.
+ * Returns pointer to the reserved space, data is added to the
+ * output by outputCommit(). Returns NULL on memory allocation
+ * error.
+ *************************************************************/
+char *outputReserve(struct outputBuffer *out, size_t length) {
+  if (out->size - out->used < length) {
+    flushOutput(out);
+
+    if (out->size - out->used < length) {
+      char  *data;
+      size_t size = (out->mode == OUTPUT_MODE_MEMORY  &&  out->size*2 > out->used + length) ?
+                      out->size*2 : out->used + length;
+
+      if ((data = fmt_realloc(out->data, size)) == NULL)
+        return NULL;
+
+      out->data = data;
+      out->size = size;
+    }
+  }
+
+  return out->data + out->used;
+}
+
+
+/*************************************************************
+ * Add 'length' bytes written to the reserved space to output
+ *
+ *************************************************************/
+void outputCommit(struct outputBuffer *out, size_t length) {
+  out->used += length;
+
+  if (out->mode == OUTPUT_MODE_LINE)
+    flushOutput(out);
+}
+
+
+/*************************************************************
+ * Add block of data to output
+ *
+ *************************************************************/
+void outputWrite(struct outputBuffer *out, const char *data, size_t length) {
+  char *reserved;
+
+  if (out->mode != OUTPUT_MODE_MEMORY  &&  length >= out->size) {
+    // Big blocks are written as is
+    flushOutput(out);
+    writeOutput(out, data, length);
+    return;
+  }
+
+  if ((reserved = outputReserve(out, length)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return;
+  }
+
+  memcpy(reserved, data, length);
+  outputCommit(out, length);
+}
+
+
+/*************************************************************
+ * Add blocks of data to output. Blocks are written after the
+ * buffered data with writev(2) without copying them to the
+ * buffer. 'blocks' are changed.
+ *************************************************************/
+void outputWritev(struct outputBuffer *out, struct iovec *blocks, int count) {
+  ssize_t result;
+
+  if (out->sink != NULL  ||  out->mode == OUTPUT_MODE_MEMORY) {
+    for (int block = 0; block < count; block++)
+      outputWrite(out, blocks[block].iov_base, blocks[block].iov_len);
+    return;
+  }
+
+  flushOutput(out);
+
+  for (int block = 0; block < count; block++)
+    out->written += blocks[block].iov_len;
+
+  while (count > 0  &&  !out->error) {
+    if (blocks->iov_len == 0) {
+      blocks++;
+      count--;
+      continue;
+    }
+
+    if ((result = writev(out->fd, blocks, count)) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      fprintf(stderr, "Output write error: %s\n", strerror(errno));
+      out->error = 1;
+      break;
+    }
+
+    // Skip written blocks, the rest of partially written block is
+    // written by the next call
+    for (; count > 0  &&  (size_t)result >= blocks->iov_len; blocks++, count--)
+      result -= blocks->iov_len;
+
+    if (count > 0) {
+      blocks->iov_base  = (char *)blocks->iov_base + result;
+      blocks->iov_len  -= result;
+    }
+  }
+}
+
+
+/*************************************************************
+ * Flush and free output buffer
+ *
+ *************************************************************/
+void closeOutputBuffer(struct outputBuffer *out) {
+  flushOutput(out);
+
+  fmt_free(out->data);
+  fmt_free(out->records.items);
+  out->data          = NULL;
+  out->records.items = NULL;
+  out->records.count = out->records.size = 0;
+}
+
+
+/*************************************************************
+ * Output position: offset of the next byte of output in the
+ * file (or in the buffer for memory buffers)
+ *************************************************************/
+static inline unsigned long long output_position(struct outputBuffer *out) {
+  return out->written + out->used;
+}
+
+
+/*************************************************************
+ * Add record, consecutive message lines are joined
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+static int add_record(struct outputRecords *records, unsigned long long offset, size_t length, int type) {
+  struct outputRecord *items, *last = records->count ? &records->items[records->count - 1] : NULL;
+
+  if (last != NULL  &&  last->type == RECORD_MESSAGE  &&  type == RECORD_MESSAGE  &&  last->offset + last->length == offset) {
+    last->length += length;
+    return 0;
+  }
+
+  if (records->count == records->size) {
+    size_t size = records->size ? records->size*2 : 64;
+
+    if ((items = fmt_realloc(records->items, size*sizeof(struct outputRecord))) == NULL)
+      return -1;
+
+    records->items = items;
+    records->size  = size;
+  }
+
+  records->items[records->count++] = (struct outputRecord){ offset, length, type };
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Record non-row line of 'length' bytes (EOL included) which is
+ * printed next
+ *************************************************************/
+void record_output(struct outputBuffer *out, int type, size_t length) {
+  if (out->records.enabled  &&  add_record(&out->records, output_position(out), length, type) != 0)
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+}
+
+
+/*************************************************************
+ * Move records of memory buffer 'from' to 'out'. Data of the
+ * buffer is added to 'out' at 'offset'.
+ *************************************************************/
+void move_records(struct outputBuffer *out, struct outputBuffer *from, unsigned long long offset) {
+  for (size_t count = 0; count < from->records.count; count++) {
+    if (add_record(&out->records, offset + from->records.items[count].offset,
+                   from->records.items[count].length, from->records.items[count].type) != 0) {
+      fprintf(stderr, "Not enough memory or memory allocation error\n");
+      break;
+    }
+  }
+
+  from->records.count = 0;
+}
+
+
+#ifdef FMTDB2_ZLIB
+
+/*************************************************************
+ * gzip input and output (FMTDB2_ZLIB builds)
+ *
+ * gzip input is detected by the magic bytes and is inflated
+ * straight into the line reader blocks by the reader source.
+ * Mapped file is inflated from the mapping, other input is read
+ * in blocks from the descriptor or from the previous source.
+ * Input which isn't gzip is passed as is. Concatenated gzip
+ * members are read one by one.
+ *
+ * Compressed output (--compress=gzip) is the sink of the output
+ * buffer: buffered output is deflated at the time it would be
+ * written and compressed blocks are written to the descriptor
+ * (or to the previous sink).
+ *************************************************************/
+#define GZIP_BLOCK_SIZE (256*1024)
+
+struct gzipInput {
+  z_stream       stream;
+  int            fd;
+  int            inflating;     // Input is gzip, otherwise it's passed as is
+  int            end;           // End of compressed input
+  int            memberEnd;     // End of gzip member, the next one may follow
+  ssize_t      (*source)(void *data, char *buffer, size_t size);
+  void          *sourceData;
+  void         (*release)(void *data);
+  char          *map;           // Mapped compressed file
+  size_t         mapLength;
+  unsigned char  buffer[GZIP_BLOCK_SIZE];
+};
+
+
+static ssize_t gzip_fill(struct gzipInput *gzip) {
+  ssize_t result;
+
+  do {
+    result = (gzip->source != NULL) ? gzip->source(gzip->sourceData, (char *)gzip->buffer, GZIP_BLOCK_SIZE) :
+                                      read(gzip->fd, gzip->buffer, GZIP_BLOCK_SIZE);
+  } while (result < 0  &&  errno == EINTR);
+
+  if (result == 0)
+    gzip->end = 1;
+  else if (result > 0) {
+    gzip->stream.next_in  = gzip->buffer;
+    gzip->stream.avail_in = result;
+  }
+
+  return result;
+}
+
+
+static ssize_t gzip_read(void *data, char *buffer, size_t size) {
+  struct gzipInput *gzip = data;
+  size_t length;
+  int    result;
+
+  if (!gzip->inflating) {
+    // Input isn't compressed, the rest of the first block is copied
+    if (gzip->stream.avail_in == 0)
+      return (gzip->source != NULL) ? gzip->source(gzip->sourceData, buffer, size) : read(gzip->fd, buffer, size);
+
+    length = (gzip->stream.avail_in < size) ? gzip->stream.avail_in : size;
+    memcpy(buffer, gzip->stream.next_in, length);
+    gzip->stream.next_in  += length;
+    gzip->stream.avail_in -= length;
+
+    return length;
+  }
+
+  gzip->stream.next_out  = (unsigned char *)buffer;
+  gzip->stream.avail_out = size;
+
+  while (gzip->stream.avail_out == size) {
+    if (gzip->stream.avail_in == 0  &&  !gzip->end  &&  gzip_fill(gzip) < 0)
+      return -1;
+
+    if (gzip->stream.avail_in == 0) {
+      if (gzip->memberEnd)
+        return 0;
+
+      fprintf(stderr, "gzip input error: unexpected end of input\n");
+      errno = EIO;
+      return -1;
+    }
+
+    if (gzip->memberEnd) {
+      // Next member of concatenated gzip file
+      inflateReset(&gzip->stream);
+      gzip->memberEnd = 0;
+    }
+
+    result = inflate(&gzip->stream, Z_NO_FLUSH);
+
+    if (result == Z_STREAM_END) {
+      gzip->memberEnd = 1;
+    } else if (result != Z_OK  &&  result != Z_BUF_ERROR) {
+      fprintf(stderr, "gzip input error: %s\n", gzip->stream.msg ? gzip->stream.msg : "data error");
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  return size - gzip->stream.avail_out;
+}
+
+
+static void gzip_release(void *data) {
+  struct gzipInput *gzip = data;
+
+  if (gzip->inflating)
+    inflateEnd(&gzip->stream);
+
+  if (gzip->map != NULL)
+    munmap(gzip->map, gzip->mapLength);
+
+  if (gzip->release != NULL)
+    gzip->release(gzip->sourceData);
+
+  fmt_free(gzip);
+}
+
+
+/*************************************************************
+ * Inflate reader input if it's gzip
+ * Returns 0 on success, -1 on error
+ *************************************************************/
+int openGzipInput(struct lineReader *reader) {
+  struct gzipInput *gzip;
+
+  if (reader->map != NULL  &&  (reader->mapLength < 2  ||  (unsigned char)reader->map[0] != 0x1f  ||
+                                (unsigned char)reader->map[1] != 0x8b))
+    return 0;
+
+  if ((gzip = fmt_calloc(1, sizeof(struct gzipInput))) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return -1;
+  }
+
+  gzip->fd         = reader->fd;
+  gzip->source     = reader->source;
+  gzip->sourceData = reader->sourceData;
+  gzip->release    = reader->release;
+
+  if (reader->map != NULL) {
+    // Mapped file is compressed input, the reader reads in blocks
+    gzip->map             = reader->map;
+    gzip->mapLength       = reader->mapLength;
+    gzip->stream.next_in  = (unsigned char *)reader->map;
+    gzip->stream.avail_in = reader->mapLength;
+    gzip->end             = 1;
+
+    reader->map      = NULL;
+    reader->position = reader->end = NULL;
+    reader->eof      = 0;
+  } else {
+    // Magic bytes are checked in the first block
+    while (gzip->stream.avail_in < 2  &&  !gzip->end) {
+      ssize_t result = (gzip->source != NULL) ?
+        gzip->source(gzip->sourceData, (char *)gzip->buffer + gzip->stream.avail_in, GZIP_BLOCK_SIZE - gzip->stream.avail_in) :
+        read(gzip->fd, gzip->buffer + gzip->stream.avail_in, GZIP_BLOCK_SIZE - gzip->stream.avail_in);
+
+      if (result < 0  &&  errno == EINTR)
+        continue;
+
+      if (result <= 0) {
+        gzip->end = (result == 0);
+        break;
+      }
+
+      gzip->stream.avail_in += result;
+    }
+
+    gzip->stream.next_in = gzip->buffer;
+  }
+
+  gzip->inflating = (gzip->stream.avail_in >= 2  &&  gzip->stream.next_in[0] == 0x1f  &&  gzip->stream.next_in[1] == 0x8b);
+
+  // Automatic header detection: gzip wrapper only
+  if (gzip->inflating  &&  inflateInit2(&gzip->stream, 15 + 16) != Z_OK) {
+    fprintf(stderr, "gzip input error: %s\n", gzip->stream.msg ? gzip->stream.msg : "can't initialize");
+    gzip->inflating = 0;
+    gzip_release(gzip);
+    return -1;
+  }
+
+  // Not compressed input which is already read is returned first,
+  // end of input is returned by the source
+  if (!gzip->inflating)
+    gzip->end = 0;
+
+  reader->source     = gzip_read;
+  reader->sourceData = gzip;
+  reader->release    = gzip_release;
+
+  return 0;
+}
+
+
+struct gzipOutput {
+  z_stream       stream;
+  int            fd;
+  int            error;
+  fmtdb2_write   sink;          // Previous sink of the output buffer
+  void          *sinkData;
+  int            stream_id;
+  unsigned char  buffer[GZIP_BLOCK_SIZE];
+};
+
+
+static int gzip_write_block(struct gzipOutput *gzip, const unsigned char *data, size_t length) {
+  ssize_t result;
+
+  if (gzip->sink != NULL)
+    return gzip->error = (gzip->sink(gzip->sinkData, gzip->stream_id, (const char *)data, length) != 0);
+
+  while (length > 0  &&  !gzip->error) {
+    if ((result = write(gzip->fd, data, length)) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      fprintf(stderr, "Output write error: %s\n", strerror(errno));
+      gzip->error = 1;
+    } else {
+      data   += result;
+      length -= result;
+    }
+  }
+
+  return gzip->error;
+}
+
+
+static int gzip_deflate(struct gzipOutput *gzip, int flush) {
+  int result;
+
+  do {
+    gzip->stream.next_out  = gzip->buffer;
+    gzip->stream.avail_out = GZIP_BLOCK_SIZE;
+
+    result = deflate(&gzip->stream, flush);
+
+    if (result == Z_STREAM_ERROR  ||
+        gzip_write_block(gzip, gzip->buffer, GZIP_BLOCK_SIZE - gzip->stream.avail_out) != 0)
+      return -1;
+  } while (gzip->stream.avail_out == 0  ||  (flush == Z_FINISH  &&  result != Z_STREAM_END));
+
+  return 0;
+}
+
+
+// Output buffer sink, see fmtdb2_write
+static int gzip_write(void *data, int stream, const char *block, size_t length) {
+  struct gzipOutput *gzip = data;
+
+  gzip->stream.next_in  = (unsigned char *)block;
+  gzip->stream.avail_in = length;
+
+  return gzip_deflate(gzip, Z_NO_FLUSH);
+}
+
+
+/*************************************************************
+ * Compress output of the buffer with 'level' (-1 - default
+ * level). Buffer has to be opened.
+ * Returns compressor or NULL on error
+ *************************************************************/
+struct gzipOutput *openGzipOutput(struct outputBuffer *out, int level) {
+  struct gzipOutput *gzip;
+
+  if ((gzip = fmt_calloc(1, sizeof(struct gzipOutput))) == NULL)
+    return NULL;
+
+  if (deflateInit2(&gzip->stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    fmt_free(gzip);
+    return NULL;
+  }
+
+  gzip->fd        = out->fd;
+  gzip->sink      = out->sink;
+  gzip->sinkData  = out->sinkData;
+  gzip->stream_id = out->stream;
+
+  // Compressed output is written in blocks anyway
+  if (out->mode == OUTPUT_MODE_LINE)
+    out->mode = OUTPUT_MODE_BLOCK;
+
+  out->sink     = gzip_write;
+  out->sinkData = gzip;
+
+  return gzip;
+}
+
+
+/*************************************************************
+ * Finish compressed stream, the output buffer has to be
+ * flushed before
+ * Returns 0 on success, -1 on write error
+ *************************************************************/
+int closeGzipOutput(struct gzipOutput *gzip) {
+  int result;
+
+  gzip->stream.avail_in = 0;
+  result = gzip_deflate(gzip, Z_FINISH);
+
+  deflateEnd(&gzip->stream);
+  fmt_free(gzip);
+
+  return result;
+}
+
+#endif
+
+
+#ifdef FMTDB2_URING
+
+/*************************************************************
+ * io_uring I/O backend (--io=uring, FMTDB2_URING builds)
+ *
+ * Input is read into URING_BUFFERS buffers ahead of the line
+ * reader: reads of regular files are in flight at consecutive
+ * offsets, other input (pipes) has one read in flight while
+ * the reader takes data of the completed buffers. Output is
+ * copied into the buffers behind the output buffer and written
+ * in the same way. Reader and writer have their own rings, the
+ * writer may work in the writer thread.
+ *
+ * Rings are used through the raw system calls.
+ *************************************************************/
+#define URING_BUFFERS     4
+#define URING_BUFFER_SIZE (1024*1024)
+
+struct uringQueue {
+  int                  fd;
+  unsigned            *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned            *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void                *sqRing, *cqRing;
+  size_t               sqRingSize, cqRingSize;
+  unsigned             pending;      // Prepared but not submitted entries
+};
+
+
+static int uring_open(struct uringQueue *queue, unsigned entries) {
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  memset(queue, 0, sizeof(*queue));
+
+  if ((queue->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+    return -1;
+
+  queue->sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+  queue->cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (queue->cqRingSize > queue->sqRingSize)
+      queue->sqRingSize = queue->cqRingSize;
+    queue->cqRingSize = queue->sqRingSize;
+  }
+
+  queue->sqRing = mmap(NULL, queue->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->fd, IORING_OFF_SQ_RING);
+  queue->cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? queue->sqRing :
+    mmap(NULL, queue->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->fd, IORING_OFF_CQ_RING);
+  queue->sqes = mmap(NULL, params.sq_entries*sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     queue->fd, IORING_OFF_SQES);
+
+  if (queue->sqRing == MAP_FAILED  ||  queue->cqRing == MAP_FAILED  ||  queue->sqes == MAP_FAILED) {
+    close(queue->fd);
+    return -1;
+  }
+
+  queue->sqHead  = (unsigned *)((char *)queue->sqRing + params.sq_off.head);
+  queue->sqTail  = (unsigned *)((char *)queue->sqRing + params.sq_off.tail);
+  queue->sqMask  = (unsigned *)((char *)queue->sqRing + params.sq_off.ring_mask);
+  queue->sqArray = (unsigned *)((char *)queue->sqRing + params.sq_off.array);
+  queue->cqHead  = (unsigned *)((char *)queue->cqRing + params.cq_off.head);
+  queue->cqTail  = (unsigned *)((char *)queue->cqRing + params.cq_off.tail);
+  queue->cqMask  = (unsigned *)((char *)queue->cqRing + params.cq_off.ring_mask);
+  queue->cqes    = (struct io_uring_cqe *)((char *)queue->cqRing + params.cq_off.cqes);
+
+  return 0;
+}
+
+
+static void uring_close(struct uringQueue *queue) {
+  munmap(queue->sqes, (*queue->sqMask + 1)*sizeof(struct io_uring_sqe));
+  if (queue->cqRing != queue->sqRing)
+    munmap(queue->cqRing, queue->cqRingSize);
+  munmap(queue->sqRing, queue->sqRingSize);
+  close(queue->fd);
+}
+
+
+/*************************************************************
+ * Prepare read or write of 'length' bytes at 'offset' (-1 -
+ * current file position). Ring has room for all buffers, so
+ * submission queue isn't full.
+ *************************************************************/
+static void uring_prepare(struct uringQueue *queue, int opcode, int fd, char *data, size_t length, off_t offset, int buffer) {
+  unsigned tail = *queue->sqTail, index = tail & *queue->sqMask;
+  struct io_uring_sqe *sqe = &queue->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = opcode;
+  sqe->fd        = fd;
+  sqe->addr      = (unsigned long)data;
+  sqe->len       = length;
+  sqe->off       = offset;
+  sqe->user_data = buffer;
+
+  queue->sqArray[index] = index;
+  __atomic_store_n(queue->sqTail, tail + 1, __ATOMIC_RELEASE);
+  queue->pending++;
+}
+
+
+/*************************************************************
+ * Submit prepared entries and wait for a completion
+ * Returns 0 and stores buffer and result of the operation or
+ * returns -1 on error (errno is set)
+ *************************************************************/
+static int uring_wait(struct uringQueue *queue, int *buffer, int *result) {
+  unsigned head;
+
+  while (1) {
+    head = *queue->cqHead;
+
+    if (head != __atomic_load_n(queue->cqTail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &queue->cqes[head & *queue->cqMask];
+
+      *buffer = cqe->user_data;
+      *result = cqe->res;
+      __atomic_store_n(queue->cqHead, head + 1, __ATOMIC_RELEASE);
+
+      return 0;
+    }
+
+    if (syscall(__NR_io_uring_enter, queue->fd, queue->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return -1;
+    }
+
+    queue->pending = 0;
+  }
+}
+
+
+static int is_seekable(int fd, off_t *offset) {
+  struct stat file_stat;
+
+  // Positioned writes of O_APPEND files go to the end in any order
+  return fstat(fd, &file_stat) == 0  &&  S_ISREG(file_stat.st_mode)  &&  !(fcntl(fd, F_GETFL) & O_APPEND)  &&
+         (*offset = lseek(fd, 0, SEEK_CUR)) >= 0;
+}
+
+
+#define URING_FREE     0
+#define URING_INFLIGHT 1
+#define URING_READY    2
+
+struct uringBuffer {
+  char   *data;
+  size_t  length;       // Data length (read result)
+  size_t  used;         // Data taken by the reader
+  off_t   offset;
+  int     state;
+};
+
+struct uringInput {
+  struct uringQueue  queue;
+  int                fd;
+  int                seekable;     // Reads are positioned, all buffers may be in flight
+  int                end;          // End of input, no more reads
+  int                error;
+  int                inflight;
+  off_t              offset;       // Offset of the next read
+  int                next;         // Buffer with the next data
+  struct uringBuffer buffers[URING_BUFFERS];
+};
+
+
+static void uring_submit_reads(struct uringInput *input) {
+  for (int count = 0; count < URING_BUFFERS  &&  !input->end  &&  (input->seekable  ||  input->inflight == 0); count++) {
+    struct uringBuffer *buffer = &input->buffers[(input->next + count) % URING_BUFFERS];
+
+    if (buffer->state != URING_FREE)
+      continue;
+
+    buffer->offset = input->seekable ? input->offset : -1;
+    buffer->state  = URING_INFLIGHT;
+    uring_prepare(&input->queue, IORING_OP_READ, input->fd, buffer->data, URING_BUFFER_SIZE, buffer->offset,
+                  buffer - input->buffers);
+
+    input->offset += URING_BUFFER_SIZE;
+    input->inflight++;
+  }
+}
+
+
+/*************************************************************
+ * Wait for completion of one read
+ * Returns 0 on success, -1 on error
+ *************************************************************/
+static int uring_complete_read(struct uringInput *input) {
+  struct uringBuffer *buffer;
+  ssize_t result;
+  int index, length;
+
+  if (uring_wait(&input->queue, &index, &length) != 0)
+    return -1;
+
+  buffer = &input->buffers[index];
+  buffer->state = URING_READY;
+  buffer->used  = 0;
+  input->inflight--;
+
+  if (length < 0) {
+    errno = -length;
+    buffer->length = 0;
+    input->error   = 1;
+    return 0;
+  }
+
+  buffer->length = length;
+
+  // Short read of a file isn't the end of file if it's followed by
+  // data, missing part is read at once
+  while (input->seekable  &&  length > 0  &&  buffer->length < URING_BUFFER_SIZE) {
+    if ((result = pread(input->fd, buffer->data + buffer->length, URING_BUFFER_SIZE - buffer->length,
+                        buffer->offset + buffer->length)) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      input->error = 1;
+      break;
+    }
+
+    if (result == 0)
+      break;
+
+    buffer->length += result;
+  }
+
+  return 0;
+}
+
+
+static ssize_t uring_read(void *data, char *out, size_t size) {
+  struct uringInput  *input = data;
+  struct uringBuffer *buffer = &input->buffers[input->next];
+  size_t length;
+
+  while (1) {
+    uring_submit_reads(input);
+
+    if (buffer->state == URING_READY)
+      break;
+
+    if (buffer->state == URING_FREE)
+      return 0;
+
+    if (uring_complete_read(input) != 0)
+      return -1;
+  }
+
+  if (buffer->length == 0) {
+    // End of input (the rest of reads are beyond it) or read error
+    input->end = 1;
+    return input->error ? -1 : 0;
+  }
+
+  length = (buffer->length - buffer->used < size) ? buffer->length - buffer->used : size;
+  memcpy(out, buffer->data + buffer->used, length);
+  buffer->used += length;
+
+  if (buffer->used == buffer->length) {
+    // Short read is the end of file
+    if (input->seekable  &&  buffer->length < URING_BUFFER_SIZE)
+      input->end = 1;
+
+    buffer->state = URING_FREE;
+    input->next   = (input->next + 1) % URING_BUFFERS;
+  }
+
+  return length;
+}
+
+
+static void uring_release_input(void *data) {
+  struct uringInput *input = data;
+
+  // Buffers can't be freed while reads are in flight
+  while (input->inflight > 0  &&  uring_complete_read(input) == 0)
+    ;
+
+  uring_close(&input->queue);
+
+  for (int count = 0; count < URING_BUFFERS; count++)
+    fmt_free(input->buffers[count].data);
+
+  fmt_free(input);
+}
+
+
+/*************************************************************
+ * Read reader input through io_uring. Mapped input is left as
+ * is.
+ * Returns 0 on success, -1 if io_uring can't be used
+ *************************************************************/
+int openUringInput(struct lineReader *reader) {
+  struct uringInput *input;
+  int count;
+
+  if (reader->map != NULL  ||  reader->source != NULL)
+    return 0;
+
+  if ((input = fmt_calloc(1, sizeof(struct uringInput))) == NULL)
+    return -1;
+
+  for (count = 0; count < URING_BUFFERS; count++) {
+    if ((input->buffers[count].data = fmt_malloc(URING_BUFFER_SIZE)) == NULL)
+      break;
+  }
+
+  if (count < URING_BUFFERS  ||  uring_open(&input->queue, URING_BUFFERS) != 0) {
+    for (count = 0; count < URING_BUFFERS; count++)
+      fmt_free(input->buffers[count].data);
+    fmt_free(input);
+    return -1;
+  }
+
+  input->fd       = reader->fd;
+  input->seekable = is_seekable(reader->fd, &input->offset);
+
+  reader->source     = uring_read;
+  reader->sourceData = input;
+  reader->release    = uring_release_input;
+
+  return 0;
+}
+
+
+struct uringOutput {
+  struct uringQueue  queue;
+  int                fd;
+  int                seekable;
+  int                lineMode;     // Output is written as soon as it's buffered
+  int                error;
+  int                inflight;
+  off_t              offset;       // Offset of the next write
+  int                next;         // Buffer being filled
+  struct uringBuffer buffers[URING_BUFFERS];
+};
+
+
+/*************************************************************
+ * Wait for completion of one write. The rest of short write is
+ * written at once.
+ *************************************************************/
+static void uring_complete_write(struct uringOutput *output) {
+  struct uringBuffer *buffer;
+  ssize_t result;
+  int index, length;
+
+  if (uring_wait(&output->queue, &index, &length) != 0) {
+    fprintf(stderr, "Output write error: %s\n", strerror(errno));
+    output->error    = 1;
+    output->inflight = 0;
+    return;
+  }
+
+  buffer = &output->buffers[index];
+  buffer->state = URING_FREE;
+  output->inflight--;
+
+  if (length < 0) {
+    if (!output->error)
+      fprintf(stderr, "Output write error: %s\n", strerror(-length));
+    output->error = 1;
+    return;
+  }
+
+  for (buffer->used = length; buffer->used < buffer->length  &&  !output->error; ) {
+    result = output->seekable ?
+      pwrite(output->fd, buffer->data + buffer->used, buffer->length - buffer->used, buffer->offset + buffer->used) :
+      write(output->fd, buffer->data + buffer->used, buffer->length - buffer->used);
+
+    if (result < 0  &&  errno != EINTR) {
+      fprintf(stderr, "Output write error: %s\n", strerror(errno));
+      output->error = 1;
+    } else if (result > 0) {
+      buffer->used += result;
+    }
+  }
+}
+
+
+static void uring_submit_write(struct uringOutput *output) {
+  struct uringBuffer *buffer = &output->buffers[output->next];
+
+  if (buffer->length == 0)
+    return;
+
+  // Writes of pipes are serialized
+  while (!output->seekable  &&  output->inflight > 0)
+    uring_complete_write(output);
+
+  buffer->offset = output->seekable ? output->offset : -1;
+  buffer->state  = URING_INFLIGHT;
+  uring_prepare(&output->queue, IORING_OP_WRITE, output->fd, buffer->data, buffer->length, buffer->offset, output->next);
+
+  output->offset += buffer->length;
+  output->inflight++;
+  output->next = (output->next + 1) % URING_BUFFERS;
+
+  // The next buffer is filled when its write is done
+  while (output->buffers[output->next].state == URING_INFLIGHT)
+    uring_complete_write(output);
+
+  output->buffers[output->next].length = 0;
+}
+
+
+// Output buffer sink, see fmtdb2_write
+static int uring_write(void *data, int stream, const char *block, size_t length) {
+  struct uringOutput *output = data;
+  struct uringBuffer *buffer;
+  size_t part;
+
+  while (length > 0  &&  !output->error) {
+    buffer = &output->buffers[output->next];
+    part   = (URING_BUFFER_SIZE - buffer->length < length) ? URING_BUFFER_SIZE - buffer->length : length;
+
+    memcpy(buffer->data + buffer->length, block, part);
+    buffer->length += part;
+    block          += part;
+    length         -= part;
+
+    if (buffer->length == URING_BUFFER_SIZE)
+      uring_submit_write(output);
+  }
+
+  if (output->lineMode  &&  !output->error)
+    uring_submit_write(output);
+
+  return output->error;
+}
+
+
+/*************************************************************
+ * Write output of the buffer through io_uring. Buffer has to be
+ * opened.
+ * Returns writer or NULL if io_uring can't be used
+ *************************************************************/
+struct uringOutput *openUringOutput(struct outputBuffer *out) {
+  struct uringOutput *output;
+  int count;
+
+  if (out->sink != NULL  ||  (output = fmt_calloc(1, sizeof(struct uringOutput))) == NULL)
+    return NULL;
+
+  for (count = 0; count < URING_BUFFERS; count++) {
+    if ((output->buffers[count].data = fmt_malloc(URING_BUFFER_SIZE)) == NULL)
+      break;
+  }
+
+  if (count < URING_BUFFERS  ||  uring_open(&output->queue, URING_BUFFERS) != 0) {
+    for (count = 0; count < URING_BUFFERS; count++)
+      fmt_free(output->buffers[count].data);
+    fmt_free(output);
+    return NULL;
+  }
+
+  output->fd       = out->fd;
+  output->seekable = is_seekable(out->fd, &output->offset);
+  output->lineMode = (out->mode == OUTPUT_MODE_LINE);
+
+  out->sink     = uring_write;
+  out->sinkData = output;
+
+  return output;
+}
+
+
+/*************************************************************
+ * Write the rest of output and wait for all writes. File
+ * position is moved to the end of written data. The output
+ * buffer has to be flushed before.
+ * Returns 0 on success, -1 on write error
+ *************************************************************/
+int closeUringOutput(struct uringOutput *output) {
+  int result;
+
+  if (!output->error)
+    uring_submit_write(output);
+
+  while (output->inflight > 0)
+    uring_complete_write(output);
+
+  if (output->seekable)
+    lseek(output->fd, output->offset, SEEK_SET);
+
+  result = output->error ? -1 : 0;
+
+  uring_close(&output->queue);
+
+  for (int count = 0; count < URING_BUFFERS; count++)
+    fmt_free(output->buffers[count].data);
+  fmt_free(output);
+
+  return result;
+}
+
+#endif
+
+
+/*************************************************************
+ * Columnar output (--format=columnar)
+ *
+ * Binary stream of length-prefixed messages. All numbers are
+ * unsigned little-endian integers.
+ *
+ *   stream:  magic "FMTDB2C1" (8 bytes), messages, end message
+ *   message: type (1 byte), payload length (4 bytes), payload
+ *
+ *   'S' - resultset schema, starts each resultset:
+ *         column count (4 bytes), then for each column name length
+ *         (2 bytes) and name
+ *   'B' - record batch of up to COLUMNAR_BATCH_ROWS rows:
+ *         row count N (4 bytes), then for each column N + 1 value
+ *         offsets (4 bytes each, relative to the column values)
+ *         followed by values. Value i of the column is the bytes
+ *         from offsets[i] to offsets[i + 1].
+ *   'T' - non-resultset line (statement echo, SQL messages, etc.)
+ *         as is, without EOL
+ *   'E' - end of stream, no payload
+ *
+ * Values are trimmed, NULL is kept as DB2 prints it ('-').
+ * Rows are collected by the builder of the output buffer and are
+ * written as a record batch when the batch is full or before the
+ * next non-batch message.
+ *************************************************************/
+#define COLUMNAR_MAGIC "FMTDB2C1"
+
+struct columnarBuilder {
+  long      columns;
+  size_t    rows;
+  uint32_t *spans;        // Value offset and length for each row and column
+  size_t    spanRows;     // Allocated rows of spans
+  char     *data;         // Values in row order
+  size_t    dataSize;
+  size_t    dataUsed;
+};
+
+
+static inline char *put_uint32(char *out, uint32_t value) {
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+
+  return out + 4;
+}
+
+
+/*************************************************************
+ * Attach columnar builder to the output buffer
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+int openColumnarOutput(struct outputBuffer *out, long columns) {
+  if ((out->columnar = fmt_calloc(1, sizeof(struct columnarBuilder))) == NULL)
+    return -1;
+
+  out->format = OUTPUT_FORMAT_COLUMNAR;
+  out->columnar->columns = columns;
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Write columnar message header and reserve space for payload
+ * Returns pointer to the payload or NULL on memory allocation
+ * error
+ *************************************************************/
+static char *columnar_message(struct outputBuffer *out, char type, size_t length) {
+  char *data;
+
+  if ((data = outputReserve(out, length + 5)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return NULL;
+  }
+
+  data[0] = type;
+  put_uint32(data + 1, length);
+
+  return data + 5;
+}
+
+
+/*************************************************************
+ * Write collected rows as a record batch
+ *
+ *************************************************************/
+void columnar_flush(struct outputBuffer *out) {
+  struct columnarBuilder *builder = out->columnar;
+  size_t length, row, offset;
+  uint32_t *span;
+  char  *data;
+  long   column;
+
+  if (builder == NULL  ||  builder->rows == 0)
+    return;
+
+  length = 4 + builder->columns*4*(builder->rows + 1) + builder->dataUsed;
+
+  if ((data = columnar_message(out, 'B', length)) != NULL) {
+    data = put_uint32(data, builder->rows);
+
+    for (column = 0; column < builder->columns; column++) {
+      // Offsets
+      for (row = 0, offset = 0, span = builder->spans + column*2; row < builder->rows; row++, span += builder->columns*2) {
+        data    = put_uint32(data, offset);
+        offset += span[1];
+      }
+      data = put_uint32(data, offset);
+
+      // Values
+      for (row = 0, span = builder->spans + column*2; row < builder->rows; row++, span += builder->columns*2) {
+        memcpy(data, builder->data + span[0], span[1]);
+        data += span[1];
+      }
+    }
+
+    outputCommit(out, length + 5);
+  }
+
+  builder->rows     = 0;
+  builder->dataUsed = 0;
+}
+
+
+/*************************************************************
+ * Start new resultset with 'layout' columns
+ *
+ *************************************************************/
+void columnar_schema(struct outputBuffer *out, struct columnLayout *layout) {
+  size_t length;
+  long   count;
+  char  *data;
+
+  columnar_flush(out);
+
+  out->columnar->columns = layout->count;
+
+  for (count = 0, length = 4; count < layout->count; count++)
+    length += 2 + layout->names[count].nameLength;
+
+  if ((data = columnar_message(out, 'S', length)) == NULL)
+    return;
+
+  data = put_uint32(data, layout->count);
+
+  for (count = 0; count < layout->count; count++) {
+    *data++ = layout->names[count].nameLength;
+    *data++ = layout->names[count].nameLength >> 8;
+    memcpy(data, layout->names[count].name, layout->names[count].nameLength);
+    data += layout->names[count].nameLength;
+  }
+
+  outputCommit(out, length + 5);
+}
+
+
+/*************************************************************
+ * Add row to the record batch. Values are taken from the input
+ * slices of the columns and trimmed.
+ *************************************************************/
+void columnar_row(struct outputBuffer *out, struct columnLayout *layout, const char *line, size_t length) {
+  struct columnarBuilder *builder = out->columnar;
+  const char *value;
+  size_t value_length;
+  uint32_t *span;
+  long   count;
+
+  if (builder->rows == builder->spanRows) {
+    size_t rows = builder->spanRows ? builder->spanRows*2 : 64;
+
+    if ((span = fmt_realloc(builder->spans, rows*layout->count*2*sizeof(uint32_t))) == NULL) {
+      fprintf(stderr, "Not enough memory or memory allocation error\n");
+      return;
+    }
+
+    builder->spans    = span;
+    builder->spanRows = rows;
+  }
+
+  if (builder->dataSize - builder->dataUsed < length) {
+    char *data;
+    size_t size = (builder->dataSize*2 > builder->dataUsed + length) ? builder->dataSize*2 : builder->dataUsed + length;
+
+    if ((data = fmt_realloc(builder->data, size)) == NULL) {
+      fprintf(stderr, "Not enough memory or memory allocation error\n");
+      return;
+    }
+
+    builder->data     = data;
+    builder->dataSize = size;
+  }
+
+  span = builder->spans + builder->rows*layout->count*2;
+
+  for (count = 0; count < layout->count; count++, span += 2) {
+    value = trim_value(layout, count, line, length, &value_length);
+
+    span[0] = builder->dataUsed;
+    span[1] = value_length;
+
+    memcpy(builder->data + builder->dataUsed, value, value_length);
+    builder->dataUsed += value_length;
+  }
+
+  if (++builder->rows == COLUMNAR_BATCH_ROWS  ||  builder->dataUsed >= COLUMNAR_BATCH_SIZE)
+    columnar_flush(out);
+}
+
+
+/*************************************************************
+ * Add non-resultset line
+ *
+ *************************************************************/
+static void columnar_text(struct outputBuffer *out, const char *line, size_t length) {
+  char *data;
+
+  columnar_flush(out);
+
+  if ((data = columnar_message(out, 'T', length)) != NULL) {
+    memcpy(data, line, length);
+    outputCommit(out, length + 5);
+  }
+}
+
+
+/*************************************************************
+ * Finish columnar stream and free the builder
+ *
+ *************************************************************/
+void closeColumnarOutput(struct outputBuffer *out, int end) {
+  if (out->columnar == NULL)
+    return;
+
+  columnar_flush(out);
+
+  if (end  &&  columnar_message(out, 'E', 0) != NULL)
+    outputCommit(out, 5);
+
+  fmt_free(out->columnar->spans);
+  fmt_free(out->columnar->data);
+  fmt_free(out->columnar);
+  out->columnar = NULL;
+}
+
+
+/*************************************************************
+ * Delimited output (--format=csv|tsv|jsonl)
+ *
+ * One line per row, values are trimmed one by one, so rowset
+ * isn't analyzed. Each resultset starts with column names line
+ * (CSV, TSV), JSON Lines objects use column names as keys.
+ * Escaping:
+ *   CSV   - values with ',' or '"' are quoted, '"' is doubled
+ *   TSV   - tab, CR and backslash are written as \t, \r and \\
+ *   JSONL - '"', backslash and control characters are escaped,
+ *           values are strings
+ * DB2 NULL ('-') is written as JSON null, CSV and TSV fields of
+ * NULL are empty or the --null string as is. Value '-' of a
+ * character column can't be told apart, it's written as NULL.
+ * Non-resultset lines are written to the messages buffer
+ * (standard error) in the input order.
+ *************************************************************/
+
+// Max length of escaped character
+#define MAX_ESCAPED_LENGTH 6
+
+static char *put_escaped(int format, char *out, const char *value, size_t length) {
+  static const char hex[] = "0123456789abcdef";
+  const char *end = value + length;
+
+  switch (format) {
+    case OUTPUT_FORMAT_CSV:
+      if (memchr(value, ',', length) == NULL  &&  memchr(value, '"', length) == NULL) {
+        memcpy(out, value, length);
+        return out + length;
+      }
+
+      *out++ = '"';
+      for (; value < end; value++) {
+        if (*value == '"')
+          *out++ = '"';
+        *out++ = *value;
+      }
+      *out++ = '"';
+
+      return out;
+
+    case OUTPUT_FORMAT_TSV:
+      for (; value < end; value++) {
+        switch (*value) {
+          case '\t': *out++ = '\\'; *out++ = 't';  break;
+          case '\r': *out++ = '\\'; *out++ = 'r';  break;
+          case '\\': *out++ = '\\'; *out++ = '\\'; break;
+          default:   *out++ = *value;
+        }
+      }
+
+      return out;
+
+    default:
+      *out++ = '"';
+      for (; value < end; value++) {
+        if (*value == '"'  ||  *value == '\\') {
+          *out++ = '\\';
+          *out++ = *value;
+        } else if ((unsigned char)*value < 0x20) {
+          memcpy(out, "\\u00", 4);
+          out[4] = hex[(unsigned char)*value >> 4];
+          out[5] = hex[*value & 0x0f];
+          out += 6;
+        } else {
+          *out++ = *value;
+        }
+      }
+      *out++ = '"';
+
+      return out;
+  }
+}
+
+
+/*************************************************************
+ * Start new resultset: print column names line (CSV, TSV) and
+ * compute max length of the row without values
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+int delimited_header(struct outputBuffer *out, struct columnLayout *layout) {
+  char separator = (out->format == OUTPUT_FORMAT_TSV) ? '\t' : ',';
+  size_t nullLength = (context->options.nullValue != NULL) ? strlen(context->options.nullValue) : 0;
+  char *data, *start;
+  long count;
+
+  layout->rowLength = 2;
+
+  for (count = 0; count < layout->count; count++)
+    layout->rowLength += layout->names[count].nameLength*MAX_ESCAPED_LENGTH + nullLength + 6;
+
+  if (out->format == OUTPUT_FORMAT_JSONL)
+    return 0;
+
+  if ((start = data = outputReserve(out, layout->rowLength)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return -1;
+  }
+
+  for (count = 0; count < layout->count; count++) {
+    data    = put_escaped(out->format, data, layout->names[count].name, layout->names[count].nameLength);
+    *data++ = separator;
+  }
+  data[-1] = '\n';
+
+  outputCommit(out, data - start);
+
+  return 0;
+}
+
+
+void delimited_row(struct outputBuffer *out, struct columnLayout *layout, const char *line, size_t length) {
+  char separator = (out->format == OUTPUT_FORMAT_TSV) ? '\t' : ',';
+  const char *value;
+  size_t value_length;
+  char *data, *start;
+  long count;
+
+  if ((start = data = outputReserve(out, layout->rowLength + length*MAX_ESCAPED_LENGTH)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return;
+  }
+
+  if (out->format == OUTPUT_FORMAT_JSONL)
+    *data++ = '{';
+
+  for (count = 0; count < layout->count; count++) {
+    value = trim_value(layout, count, line, length, &value_length);
+
+    if (out->format == OUTPUT_FORMAT_JSONL) {
+      data    = put_escaped(out->format, data, layout->names[count].name, layout->names[count].nameLength);
+      *data++ = ':';
+    }
+
+    if (value_length == 1  &&  *value == '-') {
+      // DB2 NULL
+      if (out->format == OUTPUT_FORMAT_JSONL) {
+        memcpy(data, "null", 4);
+        data += 4;
+      } else if (context->options.nullValue != NULL) {
+        value_length = strlen(context->options.nullValue);
+        memcpy(data, context->options.nullValue, value_length);
+        data += value_length;
+      }
+    } else {
+      data = put_escaped(out->format, data, value, value_length);
+    }
+    *data++ = separator;
+  }
+
+  // Last separator is replaced by the end of the row
+  if (out->format == OUTPUT_FORMAT_JSONL) {
+    data[-1] = '}';
+    *data++  = '\n';
+  } else {
+    data[-1] = '\n';
+  }
+
+  outputCommit(out, data - start);
+}
+
+
+/*************************************************************
+ * Add line and EOL to output
+ *
+ *************************************************************/
+void outputLine(struct outputBuffer *out, const char *line, size_t length) {
+  char *data;
+
+  if (out->columnar != NULL) {
+    columnar_text(out, line, length);
+    return;
+  }
+
+  if (out->messages != NULL)
+    out = out->messages;
+
+  if ((data = outputReserve(out, length + 1)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return;
+  }
+
+  memcpy(data, line, length);
+  data[length] = '\n';
+
+  outputCommit(out, length + 1);
+}
+
+
+/*************************************************************
+ * Print input line as is
+ *
+ *************************************************************/
+void print_line(const char *line, size_t length) {
+  outputLine(OUTPUT, line, length);
+}
+
+
+/*************************************************************
+ * Load and flash input which is non-relevant to the resultset
+ * printing.
+ *************************************************************/
+void flushIrrelevantLines() {
+  char * line;
+  size_t length;
+
+  while ((line = getLine(INPUT, &length)) != NULL) {
+    print_line(line, length);
+
+    if (length == 0) {
+      return;
+    }
+  }
+}
+
+
+/*************************************************************
+ * Resultset header: column names and delimiters lines.
+ * Lines are copied, so they stay valid while the input is read
+ * further.
+ *************************************************************/
+struct resultsetHeader {
+  struct inputLine lines[2];
+  size_t           sizes[2];     // Allocated space for the lines
+  int              count;        // Number of loaded lines
+};
+
+
+static int copy_header_line(struct resultsetHeader *header, int index, const char *line, size_t length) {
+  char *data;
+
+  if (length > header->sizes[index]) {
+    if ((data = fmt_realloc(header->lines[index].data, length)) == NULL) {
+      fprintf(stderr, "Not enough memory or memory allocation error\n");
+      return -1;
+    }
+
+    header->lines[index].data = data;
+    header->sizes[index]      = length;
+  }
+
+  if (length > 0)
+    memcpy(header->lines[index].data, line, length);
+  header->lines[index].length = length;
+
+  return 0;
+}
+
+
+void flushHeader(struct resultsetHeader *header) {
+  for (int count = 0; count < header->count; count++)
+    print_line(header->lines[count].data, header->lines[count].length);
+}
+
+
+void free_header(struct resultsetHeader *header) {
+  fmt_free(header->lines[0].data);
+  fmt_free(header->lines[1].data);
+}
+
+
+/*************************************************************
+ * Load header lines of the first resultset
+ * Returns number of loaded lines
+ *************************************************************/
+int read_header(struct lineReader *reader, struct resultsetHeader *header) {
+  char  *line;
+  size_t length;
+
+  for (header->count = 0; header->count < 2; header->count++) {
+    if ((line = getLine(reader, &length)) == NULL)
+      break;
+
+    if (copy_header_line(header, header->count, line, length) != 0) {
+      print_line(line, length);
+      break;
+    }
+  }
+
+  return header->count;
+}
+
+
+/*************************************************************
+ * Check if line looks like resultset delimiters line:
+ * '------------ -------- ------------- ---- ....'
+ *************************************************************/
+static int is_delimiters_line(const char *line, size_t length) {
+  size_t count;
+
+  if (length == 0  ||  line[0] != '-'  ||  line[length - 1] != '-')
+    return 0;
+
+  for (count = 1; count < length; count++) {
+    if ( line[count] != '-'  &&  (line[count] != ' '  ||  line[count - 1] != '-') )
+      return 0;
+  }
+
+  return 1;
+}
+
+
+/*************************************************************
+ * Look for the header of the next resultset: column names line
+ * followed by delimiters line of the same length. Lines before
+ * the header are printed as is.
+ * Returns 1 if header is found, 0 at the end of input
+ *************************************************************/
+int find_header(struct lineReader *reader, struct resultsetHeader *header) {
+  char  *line;
+  size_t length;
+
+  header->count = 0;
+
+  while ((line = getLine(reader, &length)) != NULL) {
+    if ( header->count == 1  &&  length == header->lines[0].length  &&  is_delimiters_line(line, length) ) {
+      if (copy_header_line(header, 1, line, length) == 0) {
+        header->count = 2;
+        return 1;
+      }
+    }
+
+    // Previous line isn't a header
+    if (header->count == 1)
+      print_line(header->lines[0].data, header->lines[0].length);
+
+    if (length == 0  ||  copy_header_line(header, 0, line, length) != 0) {
+      print_line(line, length);
+      header->count = 0;
+    } else {
+      header->count = 1;
+    }
+  }
+
+  if (header->count == 1)
+    print_line(header->lines[0].data, header->lines[0].length);
+  header->count = 0;
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Flush the rest of input as is
+ *
+ *************************************************************/
+void flushInput(struct lineReader *reader) {
+  char * line;
+  size_t length;
+
+  while ((line = getLine(reader, &length)) != NULL) {
+    print_line(line, length);
+  }
+}
+
+
+/*************************************************************
+ * Flush already preloaded lines as is
+ *
+ *************************************************************/
+void flushLines(struct inputLine *lines) {
+  for (unsigned long count = 0; lines[count].data != NULL; count++) {
+    print_line(lines[count].data, lines[count].length);
+  }
+  fmt_free(lines);
+  releaseLines(INPUT);
+}
+
+
+/*************************************************************
+ * Reserve space for 'size' columns in the layout arrays
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+static int reserve_columns(struct columnLayout *layout, long size) {
+  void *array;
+
+#define RESERVE_COLUMNS_ARRAY(field) \
+  if ((array = fmt_realloc(layout->field, size*sizeof(*layout->field))) == NULL) \
+    return -1; \
+  layout->field = array;
+
+  RESERVE_COLUMNS_ARRAY(offset)
+  RESERVE_COLUMNS_ARRAY(length)
+  RESERVE_COLUMNS_ARRAY(leftPad)
+  RESERVE_COLUMNS_ARRAY(rightPad)
+  RESERVE_COLUMNS_ARRAY(printWidth)
+  RESERVE_COLUMNS_ARRAY(rightJustified)
+  RESERVE_COLUMNS_ARRAY(checkOverflow)
+  RESERVE_COLUMNS_ARRAY(inputOffset)
+  RESERVE_COLUMNS_ARRAY(inputLength)
+  RESERVE_COLUMNS_ARRAY(profile)
+  RESERVE_COLUMNS_ARRAY(names)
+
+#undef RESERVE_COLUMNS_ARRAY
+
+  layout->size = size;
+
+  return 0;
+}
+
+
+void free_layout(struct columnLayout *layout) {
+  fmt_free(layout->offset);
+  fmt_free(layout->length);
+  fmt_free(layout->leftPad);
+  fmt_free(layout->rightPad);
+  fmt_free(layout->printWidth);
+  fmt_free(layout->rightJustified);
+  fmt_free(layout->checkOverflow);
+  fmt_free(layout->inputOffset);
+  fmt_free(layout->inputLength);
+  fmt_free(layout->profile);
+  fmt_free(layout->names);
+  fmt_free(layout->filters);
+  fmt_free(layout->separators);
+}
+
+
+/*************************************************************
+ * Get header info
+ * Layout arrays are allocated on the first call and are reused
+ * for the next resultsets.
+ * Returns 0 on success, -1 if it's not a correct header or on
+ * memory allocation error
+ *************************************************************/
+int parse_header(struct columnLayout *layout, char *lineNames, char *lineDelimiters, size_t lineLength) {
+  long columns, count;
+
+  // Allocate memory
+  if (layout->size == 0  &&  reserve_columns(layout, INITIAL_COLUMNS_CONTAINER_SIZE) != 0) {
+    fprintf(stderr, "Not enough memory or memory allocation error whileprocessing resultset header\nInitial allocation\n");
+    return -1;
+  }
+
+  /***************************************************************************
+   * Parse delemeters line: '------------ -------- ------------- ---- ....'
+   *
+   ***************************************************************************/
+  columns = 0;
+  layout->offset[columns]   =  0;
+  layout->leftPad[columns]  = -1;
+  layout->rightPad[columns] = -1;
+
+  for (count = 0; count < lineLength; count++) {
+    switch (lineDelimiters[count]) {
+      case '-':
+        // Next char of the current column. Do nothing
+        break;
+
+      case ' ':
+        // Column break. Collect column info and skip whitespace.
+        layout->length[columns] = count - layout->offset[columns];
+
+        columns++;
+
+        // Check if it's necessary to reserve additional space for columns layout
+        if (columns >= layout->size  &&  reserve_columns(layout, layout->size*2) != 0) {
+          fprintf(stderr, "Not enough memory or memory allocation error while processing resultset header\nReallocation\n");
+          return -1;
+        }
+
+        layout->offset[columns]   = count + 1;
+        layout->leftPad[columns]  = -1;
+        layout->rightPad[columns] = -1;
+        break;
+
+      default:
+        // Non-expected symbol. Stop processing
+        return -1;
+    }
+  }
+
+  layout->length[columns] = count - layout->offset[columns];
+  layout->count           = columns + 1;
+  layout->inputEnd        = count;
+
+  for (count = 0; count < layout->count; count++) {
+    layout->inputOffset[count]   = layout->offset[count];
+    layout->inputLength[count]   = layout->length[count];
+    layout->checkOverflow[count] = 0;
+  }
+
+  memset(layout->profile, 0, layout->count*sizeof(struct columnProfile));
+
+
+  /***************************************************************************
+   * Collect column names
+   *
+   ***************************************************************************/
+  for (count = 0; count < layout->count; count++) {
+    struct columnName *name = &(layout->names[count]);
+
+    // Check header format (no zero-length columns)
+    if (layout->length[count] == 0) {
+      return -1;
+    }
+
+    // 128 is a limit of column name length in DB2 UDB
+    // Nevertheless, let's check it since space for name is limited by 129 characters
+    name->nameLength = (layout->length[count] < 128)? layout->length[count] : 128;
+
+    strncpy(
+      name->name
+     ,lineNames + layout->offset[count]
+     ,name->nameLength
+    );
+    name->name[ name->nameLength ] = 0;
+
+    // Remove trailing spaces from column name
+    for (short charCounter = name->nameLength - 1; charCounter >= 0; charCounter--) {
+      if (name->name[charCounter] == ' ') {
+        name->name[charCounter] = 0;
+        name->nameLength--;
+      } else {
+        break;
+      }
+    }
+
+    // Check that column has correct name
+    if (name->nameLength == 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Bind row filters to the input positions of the resultset
+ * columns. A filter of unknown column matches no rows, so a
+ * misspelled column doesn't print the whole rowset; the run
+ * fails with the return code 2 after all.
+ * It's called before project_columns(), so filters may use
+ * columns which aren't printed.
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+int resolve_filters(struct columnLayout *layout, const struct rowFilter *filters, int filterCount) {
+  struct rowFilter *array;
+  long count;
+
+  layout->filterCount = 0;
+
+  if (filterCount == 0)
+    return 0;
+
+  if ((array = fmt_realloc(layout->filters, filterCount*sizeof(struct rowFilter))) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return -1;
+  }
+  layout->filters = array;
+
+  for (; filterCount > 0; filterCount--, filters++) {
+    for (count = 0; count < layout->count; count++) {
+      if (layout->names[count].nameLength == filters->nameLength  &&
+          strncasecmp(layout->names[count].name, filters->name, filters->nameLength) == 0)
+        break;
+    }
+
+    if (count == layout->count) {
+      fprintf(stderr, "Filter column '%.*s' is not found in resultset %lu, no rows match\n",
+              (int)filters->nameLength, filters->name, context->stats.resultsets);
+      context->stats.unknownFilters++;
+
+      array = &layout->filters[layout->filterCount++];
+      *array = *filters;
+      array->operation   = FILTER_NONE;
+      array->inputOffset = 0;
+      array->inputLength = 0;
+      continue;
+    }
+
+    array = &layout->filters[layout->filterCount++];
+    *array = *filters;
+    array->inputOffset = layout->inputOffset[count];
+    array->inputLength = layout->inputLength[count];
+  }
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Keep only columns listed in 'columns' (comma separated names,
+ * case insensitive) in the listed order. Dropped columns aren't
+ * analyzed, checked or printed at all.
+ * Returns 0 on success, -1 if no columns are found or on memory
+ * allocation error
+ *************************************************************/
+int project_columns(struct columnLayout *layout, const char *columns) {
+  const char *name, *end;
+  long   *order, selected = 0, count;
+  size_t  length;
+  char   *buffer;
+
+  for (name = columns, count = 1; *name != 0; name++)
+    count += (*name == ',');
+
+  if ((order = fmt_malloc(count*sizeof(long))) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return -1;
+  }
+
+  // Find listed columns
+  for (name = columns; ; name = end + 1) {
+    if ((end = strchr(name, ',')) == NULL)
+      end = name + strlen(name);
+
+    length = end - name;
+
+    for (count = 0; count < layout->count; count++) {
+      if (layout->names[count].nameLength == length  &&  strncasecmp(layout->names[count].name, name, length) == 0)
+        break;
+    }
+
+    if (count < layout->count)
+      order[selected++] = count;
+    else if (length > 0)
+      fprintf(stderr, "Warning: column '%.*s' is not found in resultset %lu\n", (int)length, name, context->stats.resultsets);
+
+    if (*end == 0)
+      break;
+  }
+
+  if (selected == 0  ||
+      (selected > layout->size  &&  reserve_columns(layout, selected) != 0)  ||
+      (buffer = fmt_malloc(layout->count*sizeof(struct columnName))) == NULL) {
+    if (selected != 0)
+      fprintf(stderr, "Not enough memory or memory allocation error\n");
+    fmt_free(order);
+    return -1;
+  }
+
+  // Gather selected columns, columns may be listed more than once
+#define PROJECT_COLUMNS_ARRAY(field) \
+  memcpy(buffer, layout->field, layout->count*sizeof(*layout->field)); \
+  for (count = 0; count < selected; count++) \
+    memcpy(&layout->field[count], buffer + order[count]*sizeof(*layout->field), sizeof(*layout->field));
+
+  PROJECT_COLUMNS_ARRAY(offset)
+  PROJECT_COLUMNS_ARRAY(length)
+  PROJECT_COLUMNS_ARRAY(inputOffset)
+  PROJECT_COLUMNS_ARRAY(inputLength)
+  PROJECT_COLUMNS_ARRAY(names)
+
+#undef PROJECT_COLUMNS_ARRAY
+
+  for (count = 0; count < selected; count++) {
+    layout->leftPad[count]       = -1;
+    layout->rightPad[count]      = -1;
+    layout->checkOverflow[count] = 0;
+  }
+
+  memset(layout->profile, 0, selected*sizeof(struct columnProfile));
+
+  layout->count = selected;
+
+  fmt_free(buffer);
+  fmt_free(order);
+
+  return 0;
+}
+
+
+/*************************************************************
+ * UTF-8 rows (--utf8)
+ *
+ * DB2 CLP pads columns by display width, so layout positions
+ * are display cells and match bytes only for ASCII rows. Rows
+ * are checked for non-ASCII bytes as a whole, only the rare
+ * non-ASCII rows are decoded. For such a row a row layout is
+ * built: a copy of the columns layout with byte positions of
+ * the row, so per row functions handle it as usual. Output plan
+ * widths are adjusted by the number of extra bytes of each
+ * printed slice, pads are the same since spaces are ASCII.
+ *************************************************************/
+static inline int is_ascii(const char *line, size_t length) {
+  size_t   pos = 0;
+  uint64_t word, bits = 0;
+
+#if defined(__AVX2__)
+  for (; pos + 32 <= length; pos += 32) {
+    if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(line + pos))) != 0)
+      return 0;
+  }
+#elif defined(__SSE2__)
+  for (; pos + 16 <= length; pos += 16) {
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(line + pos))) != 0)
+      return 0;
+  }
+#endif
+
+  for (; pos + 8 <= length; pos += 8) {
+    memcpy(&word, line + pos, 8);
+    bits |= word;
+  }
+
+  for (; pos < length; pos++)
+    bits |= (unsigned char)line[pos];
+
+  return (bits & 0x8080808080808080ULL) == 0;
+}
+
+
+/*************************************************************
+ * Decode UTF-8 character. Invalid bytes are taken one by one.
+ * Returns length of the character in bytes
+ *************************************************************/
+static size_t decode_utf8(const unsigned char *data, size_t length, uint32_t *code) {
+  size_t size, count;
+
+  if (data[0] < 0x80) {
+    *code = data[0];
+    return 1;
+  }
+
+  if      ((data[0] & 0xE0) == 0xC0) { size = 2; *code = data[0] & 0x1F; }
+  else if ((data[0] & 0xF0) == 0xE0) { size = 3; *code = data[0] & 0x0F; }
+  else if ((data[0] & 0xF8) == 0xF0) { size = 4; *code = data[0] & 0x07; }
+  else                               { size = 0; }
+
+  for (count = 1; count < size; count++) {
+    if (count >= length  ||  (data[count] & 0xC0) != 0x80)
+      break;
+
+    *code = (*code << 6) | (data[count] & 0x3F);
+  }
+
+  if (size == 0  ||  count < size) {
+    *code = data[0];
+    return 1;
+  }
+
+  return size;
+}
+
+
+/*************************************************************
+ * Get display width of the character: 0 for combining marks,
+ * 2 for East Asian wide and fullwidth characters, 1 otherwise
+ *************************************************************/
+static int display_width(uint32_t code) {
+  static const uint32_t zero[][2] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x0610, 0x061A }, { 0x064B, 0x065F },
+    { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF },
+    { 0x200B, 0x200F }, { 0x20D0, 0x20FF }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F }
+  };
+  static const uint32_t wide[][2] = {
+    { 0x1100, 0x115F }, { 0x2E80, 0x303E }, { 0x3041, 0x33FF }, { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF },
+    { 0xA000, 0xA4CF }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE30, 0xFE4F }, { 0xFF00, 0xFF60 },
+    { 0xFFE0, 0xFFE6 }, { 0x1F300, 0x1F64F }, { 0x1F900, 0x1F9FF }, { 0x20000, 0x3FFFD }
+  };
+  size_t count;
+
+  if (code < 0x0300)
+    return 1;
+
+  for (count = 0; count < sizeof(zero)/sizeof(zero[0]); count++) {
+    if (code >= zero[count][0]  &&  code <= zero[count][1])
+      return 0;
+  }
+
+  for (count = 0; count < sizeof(wide)/sizeof(wide[0]); count++) {
+    if (code >= wide[count][0]  &&  code <= wide[count][1])
+      return 2;
+  }
+
+  return 1;
+}
+
+
+/*************************************************************
+ * Get byte positions of display cells 0..'limit' of the row.
+ * Combining marks belong to the previous cell, a cell in the
+ * middle of a wide character starts with it, so the character
+ * isn't taken by narrower slices. Cells beyond the
+ * end of line start at the end of line.
+ * Returns number of display cells up to 'limit' (may be a bit
+ * greater) which the row has
+ *************************************************************/
+static size_t map_cells(const char *line, size_t length, size_t limit, size_t *cells) {
+  size_t   pos = 0, cell = 0, next;
+  uint32_t code;
+  int      width;
+
+  while (pos < length  &&  cell <= limit) {
+    next  = pos + decode_utf8((const unsigned char *)line + pos, length - pos, &code);
+    width = display_width(code);
+
+    if (width > 0) {
+      cells[cell] = pos;
+
+      if (width == 2  &&  cell + 1 <= limit)
+        cells[cell + 1] = pos;
+
+      cell += width;
+    }
+
+    pos = next;
+  }
+
+  for (next = cell; next <= limit; next++)
+    cells[next] = length;
+
+  return cell;
+}
+
+
+/*************************************************************
+ * Get display width of UTF-8 string
+ *
+ *************************************************************/
+static size_t display_length(const char *value, size_t length) {
+  size_t   pos, width = 0;
+  uint32_t code;
+
+  for (pos = 0; pos < length; )  {
+    pos   += decode_utf8((const unsigned char *)value + pos, length - pos, &code);
+    width += display_width(code);
+  }
+
+  return width;
+}
+
+
+struct utf8Row {
+  struct columnLayout layout;         // Row layout
+  size_t             *cells;          // Byte positions of display cells
+  size_t              cellsSize;
+  long                columnsSize;
+  long                filtersSize;
+};
+
+// Row layout is built by each thread for its own rows
+static _Thread_local struct utf8Row utf8Row;
+
+
+static void free_utf8_row(void) {
+  fmt_free(utf8Row.cells);
+  fmt_free(utf8Row.layout.offset);
+  fmt_free(utf8Row.layout.length);
+  fmt_free(utf8Row.layout.printWidth);
+  fmt_free(utf8Row.layout.inputOffset);
+  fmt_free(utf8Row.layout.inputLength);
+  fmt_free(utf8Row.layout.filters);
+
+  memset(&utf8Row, 0, sizeof(utf8Row));
+}
+
+
+/*************************************************************
+ * Build layout of non-ASCII row: columns layout with byte
+ * positions of the row. The row layout is valid up to the next
+ * call in the same thread.
+ * Returns row layout or NULL on memory allocation error
+ *************************************************************/
+static struct columnLayout *utf8_row_layout(struct columnLayout *layout, const char *line, size_t length) {
+  struct utf8Row      *row    = &utf8Row;
+  struct columnLayout *result = &row->layout;
+  size_t *cells, rowCells, start;
+  long    count;
+  void   *array;
+
+  if (row->cellsSize < layout->inputEnd + 1) {
+    if ((array = fmt_realloc(row->cells, (layout->inputEnd + 1)*sizeof(size_t))) == NULL)
+      return NULL;
+
+    row->cells     = array;
+    row->cellsSize = layout->inputEnd + 1;
+  }
+
+  if (row->columnsSize < layout->count) {
+#define RESERVE_ROW_ARRAY(field) \
+    if ((array = fmt_realloc(result->field, layout->count*sizeof(*result->field))) == NULL) \
+      return NULL; \
+    result->field = array;
+
+    RESERVE_ROW_ARRAY(offset)
+    RESERVE_ROW_ARRAY(length)
+    RESERVE_ROW_ARRAY(printWidth)
+    RESERVE_ROW_ARRAY(inputOffset)
+    RESERVE_ROW_ARRAY(inputLength)
+
+#undef RESERVE_ROW_ARRAY
+
+    row->columnsSize = layout->count;
+  }
+
+  if (row->filtersSize < layout->filterCount) {
+    if ((array = fmt_realloc(result->filters, layout->filterCount*sizeof(struct rowFilter))) == NULL)
+      return NULL;
+
+    result->filters  = array;
+    row->filtersSize = layout->filterCount;
+  }
+
+  cells    = row->cells;
+  rowCells = map_cells(line, length, layout->inputEnd, cells);
+
+  // Shared fields: pads, output plan flags, names and profile
+  result->count          = layout->count;
+  result->passthrough    = layout->passthrough;
+  result->reflow         = layout->reflow;
+  result->profiling      = layout->profiling;
+  result->utf8           = UTF8_ROW;
+  result->leftPad        = layout->leftPad;
+  result->rightPad       = layout->rightPad;
+  result->rightJustified = layout->rightJustified;
+  result->checkOverflow  = layout->checkOverflow;
+  result->profile        = layout->profile;
+  result->names          = layout->names;
+  result->filterCount    = layout->filterCount;
+
+  // Short row doesn't match the layout (see is_valid_row())
+  result->inputEnd  = (rowCells >= layout->inputEnd) ? cells[layout->inputEnd] : length + 1;
+  result->rowLength = layout->rowLength + cells[layout->inputEnd] - layout->inputEnd;
+
+  for (count = 0; count < layout->count; count++) {
+    start = layout->inputOffset[count];
+
+    result->inputOffset[count] = cells[start];
+    result->inputLength[count] = cells[start + layout->inputLength[count]] - cells[start];
+
+    start = layout->offset[count];
+
+    result->offset[count]     = cells[start];
+    result->length[count]     = cells[start + layout->length[count]] - cells[start];
+    result->printWidth[count] = layout->printWidth[count] + result->length[count] -
+                                display_length(line + result->offset[count], result->length[count]);
+  }
+
+  for (count = 0; count < layout->filterCount; count++) {
+    start = layout->filters[count].inputOffset;
+
+    result->filters[count] = layout->filters[count];
+    result->filters[count].inputOffset = cells[start];
+    result->filters[count].inputLength = cells[start + layout->filters[count].inputLength] - cells[start];
+  }
+
+  return result;
+}
+
+
+/*************************************************************
+ * Get space mask of 64 bytes: bit N is set if data[N] is a
+ * space
+ *************************************************************/
+static inline uint64_t space_word(const char *data) {
+#if defined(__AVX2__)
+  const __m256i spaces = _mm256_set1_epi8(' ');
+  uint32_t low  = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)data),        spaces));
+  uint32_t high = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + 32)), spaces));
+
+  return (uint64_t)high << 32  |  low;
+#elif defined(__SSE2__)
+  const __m128i spaces = _mm_set1_epi8(' ');
+  uint64_t q0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)data),        spaces));
+  uint64_t q1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), spaces));
+  uint64_t q2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), spaces));
+  uint64_t q3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), spaces));
+
+  return q3 << 48  |  q2 << 32  |  q1 << 16  |  q0;
+#else
+  uint64_t bits = 0;
+
+  for (int bit = 0; bit < 64; bit++) {
+    if (data[bit] == ' ')
+      bits |= (uint64_t)1 << bit;
+  }
+
+  return bits;
+#endif
+}
+
+
+/*************************************************************
+ * Build space mask of the line: bit N of the mask is set if
+ * line[N] is a space. Positions starting from 'length' are
+ * treated as spaces. Mask must have room for length/64 + 1
+ * words.
+ *************************************************************/
+static void build_space_mask(const char *line, size_t length, uint64_t *mask) {
+  size_t pos = 0, word = 0, bit;
+  uint64_t bits;
+
+#if defined(__AVX2__)  ||  defined(__SSE2__)
+  for (; pos + 64 <= length; pos += 64, word++)
+    mask[word] = space_word(line + pos);
+#endif
+
+  // Tail of the line (whole line for scalar build)
+  for (;; word++) {
+    bits = ~(uint64_t)0;
+
+    for (bit = 0; bit < 64  &&  pos < length; bit++, pos++) {
+      if (line[pos] != ' ')
+        bits &= ~((uint64_t)1 << bit);
+    }
+
+    mask[word] = bits;
+
+    if (bit < 64)
+      // End of line is in this word
+      break;
+  }
+}
+
+
+static inline int ctz64(uint64_t bits) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(bits);
+#else
+  int count = 0;
+  while ((bits & 1) == 0) { bits >>= 1; count++; }
+  return count;
+#endif
+}
+
+
+static inline int clz64(uint64_t bits) {
+#if defined(__GNUC__)
+  return __builtin_clzll(bits);
+#else
+  int count = 0;
+  while ((bits & ((uint64_t)1 << 63)) == 0) { bits <<= 1; count++; }
+  return count;
+#endif
+}
+
+
+/*************************************************************
+ * Classify line which doesn't match resultset layout
+ * Returns:
+ *  1 - SQL error or warning
+ * -1 - non-DB2 output
+ *************************************************************/
+int invalid_row_state(char* line, size_t length, int state) {
+  if (state == 1  ||  (length >= 3 && strncmp(line, "SQL", 3) == 0)) {
+    // SQL error or warning
+    return 1;
+  }
+
+  return -1;
+}
+
+
+/*************************************************************
+ * Build separator mask of the layout: positions following the
+ * input slices of the columns, grouped by 64 positions.
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+int build_separators(struct columnLayout *layout) {
+  long   count, word;
+  size_t offset;
+  void  *array;
+
+  if (layout->separatorsSize < layout->count) {
+    if ((array = fmt_realloc(layout->separators, layout->count*sizeof(struct separatorWord))) == NULL)
+      return -1;
+
+    layout->separators     = array;
+    layout->separatorsSize = layout->count;
+  }
+
+  layout->separatorCount = 0;
+
+  for (count = 0; count < layout->count; count++) {
+    offset = layout->inputOffset[count] + layout->inputLength[count];
+
+    // Projected columns may be in any order
+    for (word = 0; word < layout->separatorCount  &&  layout->separators[word].position != (offset & ~(size_t)63); word++)
+      ;
+
+    if (word == layout->separatorCount) {
+      layout->separators[word].position = offset & ~(size_t)63;
+      layout->separators[word].bits     = 0;
+      layout->separatorCount++;
+    }
+
+    layout->separators[word].bits |= (uint64_t)1 << (offset & 63);
+  }
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Check, that line matches the layout (see is_valid_row()).
+ * Non-ASCII rows of UTF-8 input are checked against their row
+ * layout.
+ *************************************************************/
+static int matches_layout(struct columnLayout *layout, char* line, size_t length, int state) {
+  struct separatorWord *separator, *end;
+  long     count;
+  size_t   offset;
+  uint64_t bits;
+
+  if (layout->inputEnd > length)
+    return invalid_row_state(line, length, state);
+
+  // Separators are checked at the input positions, so values wider
+  // than the output plan don't end the rowset
+  if (layout->separators != NULL) {
+    // 64 positions are compared at once, separators at the end of
+    // line are checked one by one
+    for (separator = layout->separators, end = separator + layout->separatorCount; separator < end; separator++) {
+      if (separator->position + 64 <= length) {
+        if ((space_word(line + separator->position) & separator->bits) != separator->bits)
+          return invalid_row_state(line, length, state);
+        continue;
+      }
+
+      for (bits = separator->bits; bits != 0; bits &= bits - 1) {
+        offset = separator->position + ctz64(bits);
+
+        if (offset < length  &&  line[offset] != ' ')
+          return invalid_row_state(line, length, state);
+      }
+    }
+
+    return 0;
+  }
+
+  for (count = 0; count < layout->count; count++) {
+    offset = layout->inputOffset[count] + layout->inputLength[count];
+
+    if (offset < length  &&  line[offset] != ' ') {
+      return invalid_row_state(line, length, state);
+    }
+  }
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Check, that line looks like valid resultset row
+ * Returns:
+ *  0 - valid row
+ *  1 - SQL error or warning
+ * -1 - non-DB2 output
+ *
+ *************************************************************/
+int is_valid_row(struct columnLayout *layout, char* line, size_t length, int state) {
+  if (state == -1)  return -1;
+
+  if (layout->utf8 == UTF8_CELLS  &&  !is_ascii(line, length)  &&  (layout = utf8_row_layout(layout, line, length)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return -1;
+  }
+
+  return matches_layout(layout, line, length, state);
+}
+
+
+/*************************************************************
+ * Get processing state after the line (see process_row())
+ *
+ *************************************************************/
+int next_row_state(struct columnLayout *layout, char *line, size_t length, int state) {
+  switch (state) {
+    case 1:
+      // SQL error or warning lasts up to empty line
+      return (length == 0) ? 0 : 1;
+
+    case 0:
+      return is_valid_row(layout, line, length, state);
+  }
+
+  return -1;
+}
+
+
+/*************************************************************
+ * Check if value has non-space characters outside of the
+ * output plan of the column
+ *************************************************************/
+static int is_overflow(struct columnLayout *layout, long column, const char *line, size_t length) {
+  const char *pos, *end;
+
+  for (pos = line + layout->inputOffset[column], end = line + layout->offset[column]; pos < end; pos++) {
+    if (*pos != ' ')
+      return 1;
+  }
+
+  for (pos = line + layout->offset[column] + layout->length[column], end = line + layout->inputOffset[column] + input_length(layout, column, length); pos < end; pos++) {
+    if (*pos != ' ')
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Overflow counters
+ * Values wider than the output plan are counted per column. The
+ * counters are followed by the narrowest left pads and the
+ * narrowest right pads of such values, stored plus one (0 - no
+ * value), they widen the cached layout (see cache_layout()).
+ *************************************************************/
+#define OVERFLOW_COUNTERS(count) (3*(count) + 1)
+
+static inline void keep_narrower_pad(unsigned long *pad, unsigned long value) {
+  if (value != 0  &&  (*pad == 0  ||  *pad > value))
+    *pad = value;
+}
+
+static void merge_overflows(long count, unsigned long *overflows, const unsigned long *added) {
+  for (long column = 0; column < count; column++) {
+    overflows[column] += added[column];
+    keep_narrower_pad(&overflows[count + column], added[count + column]);
+    keep_narrower_pad(&overflows[2*count + column], added[2*count + column]);
+  }
+}
+
+
+/*************************************************************
+ * Print value which is wider than the output plan of the
+ * column. Whole value is printed, row alignment is broken.
+ * Returns pointer to the end of printed value.
+ *************************************************************/
+static char *print_overflow(struct columnLayout *layout, long column, const char *line, size_t line_length, char *out, unsigned long *overflows) {
+  const char *value = line + layout->inputOffset[column];
+  size_t      length = input_length(layout, column, line_length), width, pad;
+
+  while (*value == ' ') {
+    value++;
+    length--;
+  }
+
+  while (value[length - 1] == ' ') {
+    length--;
+  }
+
+  // Pads are spaces, they are the same in bytes and display cells
+  pad = value - (line + layout->inputOffset[column]);
+  keep_narrower_pad(&overflows[layout->count + column], pad + 1);
+  keep_narrower_pad(&overflows[2*layout->count + column], layout->inputLength[column] - pad - length + 1);
+
+  width = length;
+
+  if (layout->utf8 == UTF8_ROW) {
+    // Print width of the row layout includes extra bytes of the
+    // output plan slice only
+    width = display_length(value, length) + layout->length[column] -
+            display_length(line + layout->offset[column], layout->length[column]);
+  }
+
+  pad = (width < layout->printWidth[column]) ? layout->printWidth[column] - width : 0;
+
+  if (layout->rightJustified[column]) {
+    memset(out, ' ', pad);
+    memcpy(out + pad, value, length);
+  } else {
+    memcpy(out, value, length);
+    memset(out + length, ' ', pad);
+  }
+
+  overflows[column]++;
+
+  return out + length + pad;
+}
+
+
+/*************************************************************
+ * Print column value padded to the field width and followed by
+ * the separator. Value and pad positions are computed from the
+ * justification flag, so there is no branch on it.
+ *************************************************************/
+static inline char *emit_column(struct columnLayout *layout, long column, char *line, size_t length, char *out, unsigned long *overflows) {
+  size_t pad, right;
+
+  if (layout->checkOverflow[column]  &&  is_overflow(layout, column, line, length)) {
+    out = print_overflow(layout, column, line, length, out, overflows);
+  } else {
+    pad   = layout->printWidth[column] - layout->length[column];
+    right = -(size_t)layout->rightJustified[column];
+
+    // Pad follows the value or the value follows the pad
+    memset(out + (layout->length[column] & ~right), ' ', pad);
+    memcpy(out + (pad & right), line + layout->offset[column], layout->length[column]);
+
+    out += layout->printWidth[column];
+  }
+
+  *out++ = ' ';
+
+  return out;
+}
+
+
+/*************************************************************
+ * Print rowset line.
+ * Row is assembled in the output buffer according to the output
+ * plan. Values wider than the plan are counted in 'overflows'
+ * (per column counters).
+ * The column loop isn't specialized per header: emitters
+ * unrolled by column count weren't faster (see fmt_db2_bench).
+ *************************************************************/
+void print_row(struct columnLayout *layout, char *line, size_t length, struct outputBuffer *output, unsigned long *overflows) {
+  long   count;
+  char  *out, *start;
+
+  if (output->format == OUTPUT_FORMAT_COLUMNAR) {
+    columnar_row(output, layout, line, length);
+    return;
+  } else if (output->format != OUTPUT_FORMAT_TEXT) {
+    delimited_row(output, layout, line, length);
+    return;
+  }
+
+  if (layout->passthrough) {
+    // Valid row is at least as long as the input layout
+    outputLine(output, line, layout->rowLength - 1);
+    return;
+  }
+
+  // Values wider than the output plan may take up to the whole input
+  // line in addition to the planned row length
+  if ((start = out = outputReserve(output, layout->rowLength + length)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return;
+  }
+
+  for (count = 0; count < layout->count; count++)
+    out = emit_column(layout, count, line, length, out, overflows);
+  out[-1] = '\n';
+
+  outputCommit(output, out - start);
+}
+
+
+/*************************************************************
+ * Enable check of values wider than the output plan for the
+ * columns which are narrowed.
+ *************************************************************/
+void enable_overflow_check(struct columnLayout *layout) {
+  for (long count = 0; count < layout->count; count++) {
+    layout->checkOverflow[count] = (layout->inputOffset[count] != layout->offset[count]  ||
+                                    layout->inputLength[count] != layout->length[count]);
+  }
+}
+
+
+/*************************************************************
+ * Report values which were wider than the output plan
+ *
+ *************************************************************/
+void report_overflows(struct columnLayout *layout, unsigned long *overflows) {
+  for (long count = 0; count < layout->count; count++) {
+    if (overflows[count] != 0) {
+      fprintf(stderr, "Warning: %lu value(s) of column '%s' are wider than the column width computed from the sample and are printed unaligned\n",
+              overflows[count], layout->names[count].name);
+    }
+  }
+}
+
+
+/*************************************************************
+ * Find first non-space position in [from, to) using space mask
+ * Returns 'to' if there are only spaces
+ *************************************************************/
+static inline size_t first_nonspace(const uint64_t *mask, size_t from, size_t to) {
+  size_t   word = from >> 6;
+  uint64_t bits = ~mask[word] & (~(uint64_t)0 << (from & 63));
+
+  while (bits == 0) {
+    if ((++word << 6) >= to)
+      return to;
+
+    bits = ~mask[word];
+  }
+
+  from = (word << 6) + ctz64(bits);
+
+  return (from < to) ? from : to;
+}
+
+
+/*************************************************************
+ * Find last non-space position before 'to' using space mask
+ * There must be at least one non-space position in the column
+ *************************************************************/
+static inline size_t last_nonspace(const uint64_t *mask, size_t to) {
+  size_t   word = (to - 1) >> 6;
+  uint64_t bits = ~mask[word] & (~(uint64_t)0 >> (63 - ((to - 1) & 63)));
+
+  while (bits == 0) {
+    bits = ~mask[--word];
+  }
+
+  return (word << 6) + 63 - clz64(bits);
+}
+
+
+/*************************************************************
+ * Rowset analyzer (pass 1)
+ * Collects left/right padding info row by row.
+ * Space mask of each row is built in one pass over the row and
+ * is used both for separators check and for left/right padding
+ * calculation.
+ *************************************************************/
+struct rowsetAnalyzer {
+  struct columnLayout *layout;
+  long     *leftPad;          // Collected pads, layout pads by default
+  long     *rightPad;
+  struct columnProfile *profile;  // Collected profile, layout profile by default
+  uint64_t *separators;       // Expected separator positions
+  uint64_t *mask;             // Space mask of the current row
+  size_t    separatorWords;   // Words of separators and row masks
+  size_t    rowEnd;           // Minimal length of the row
+  size_t    maskEnd;          // Mask covers analyzed columns and their separators only
+  long      saturated;        // Columns which can't be narrowed any more
+  int       state;            // 0 - row is expected, 1 - SQL message, 2 - end of rowset
+};
+
+
+/*************************************************************
+ * Column is saturated when it has no pads, the rest of rowset
+ * can't change its output plan
+ *************************************************************/
+static inline int is_saturated(const long *leftPad, const long *rightPad, long column) {
+  return leftPad[column] == 0  &&  rightPad[column] == 0;
+}
+
+
+static long count_saturated(struct columnLayout *layout) {
+  long count, saturated = 0;
+
+  for (count = 0; count < layout->count; count++)
+    saturated += is_saturated(layout->leftPad, layout->rightPad, count);
+
+  return saturated;
+}
+
+
+/*************************************************************
+ * Prepare analyzer for the columns layout
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+int init_analyzer(struct rowsetAnalyzer *analyzer, struct columnLayout *layout) {
+  long   columnCount;
+  size_t end;
+
+  analyzer->layout   = layout;
+  analyzer->leftPad  = layout->leftPad;
+  analyzer->rightPad = layout->rightPad;
+  analyzer->profile  = layout->profile;
+  analyzer->state     = 0;
+  analyzer->rowEnd    = layout->inputEnd;
+  analyzer->maskEnd   = 0;
+  analyzer->saturated = count_saturated(layout);
+
+  // Mask of expected separator positions. Space (or EOL) is expected
+  // right after each column.
+  for (columnCount = 0; columnCount < layout->count; columnCount++) {
+    end = layout->offset[columnCount] + layout->length[columnCount];
+
+    if (analyzer->maskEnd < end + 1)
+      analyzer->maskEnd = end + 1;
+  }
+
+  analyzer->separatorWords = analyzer->maskEnd/64 + 1;
+
+  if ( (analyzer->separators = fmt_calloc(analyzer->separatorWords, sizeof(uint64_t))) == NULL  ||
+       (analyzer->mask       = fmt_malloc(analyzer->separatorWords*sizeof(uint64_t)))  == NULL ) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    fmt_free(analyzer->separators);
+    return -1;
+  }
+
+  for (columnCount = 0; columnCount < layout->count; columnCount++) {
+    end = layout->offset[columnCount] + layout->length[columnCount];
+    analyzer->separators[end >> 6] |= (uint64_t)1 << (end & 63);
+  }
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Free analyzer buffers
+ *
+ *************************************************************/
+void free_analyzer(struct rowsetAnalyzer *analyzer) {
+  fmt_free(analyzer->mask);
+  fmt_free(analyzer->separators);
+}
+
+
+/*************************************************************
+ * Check if value looks like a number: [+-]digits[.digits][E[+-]digits]
+ *
+ *************************************************************/
+static int is_numeric(const char *value, size_t length) {
+  const char *end = value + length;
+  int digits = 0;
+
+  if (value < end  &&  (*value == '+'  ||  *value == '-'))
+    value++;
+
+  for (; value < end  &&  *value >= '0'  &&  *value <= '9'; value++)
+    digits++;
+
+  if (value < end  &&  *value == '.') {
+    for (value++; value < end  &&  *value >= '0'  &&  *value <= '9'; value++)
+      digits++;
+  }
+
+  if (digits == 0)
+    return 0;
+
+  if (value < end  &&  (*value == 'E'  ||  *value == 'e')) {
+    value++;
+
+    if (value < end  &&  (*value == '+'  ||  *value == '-'))
+      value++;
+
+    if (value == end)
+      return 0;
+
+    for (; value < end  &&  *value >= '0'  &&  *value <= '9'; value++)
+      ;
+  }
+
+  return value == end;
+}
+
+
+/*************************************************************
+ * Check if the row matches all row filters. Values are compared
+ * as they are in the input row, without leading and trailing
+ * spaces. Numeric compare doesn't match non-numeric values and
+ * NULLs.
+ *************************************************************/
+static int matches_filters(struct columnLayout *layout, const char *line, size_t length) {
+  const struct rowFilter *filter;
+  const char *value, *end;
+  char   number[64];
+  double compared;
+  long   count;
+  int    matched;
+
+  for (count = 0; count < layout->filterCount; count++) {
+    filter = &layout->filters[count];
+
+    value = line + ((filter->inputOffset < length) ? filter->inputOffset : length);
+    end   = line + ((filter->inputOffset + filter->inputLength < length) ? filter->inputOffset + filter->inputLength : length);
+
+    while (value < end  &&  *value == ' ')
+      value++;
+
+    while (end > value  &&  end[-1] == ' ')
+      end--;
+
+    switch (filter->operation) {
+      case FILTER_EQUAL:
+      case FILTER_NOT_EQUAL:
+        matched = ((size_t)(end - value) == filter->valueLength  &&  memcmp(value, filter->value, filter->valueLength) == 0);
+
+        if (filter->operation == FILTER_NOT_EQUAL)
+          matched = !matched;
+        break;
+
+      case FILTER_PREFIX:
+        matched = ((size_t)(end - value) >= filter->valueLength  &&  memcmp(value, filter->value, filter->valueLength) == 0);
+        break;
+
+      case FILTER_NONE:
+        return 0;
+
+      default:
+        if (end - value >= (long)sizeof(number)  ||  !is_numeric(value, end - value))
+          return 0;
+
+        memcpy(number, value, end - value);
+        number[end - value] = 0;
+        compared = strtod(number, NULL);
+
+        matched = (filter->operation == FILTER_LESS)          ? compared <  filter->number :
+                  (filter->operation == FILTER_LESS_EQUAL)    ? compared <= filter->number :
+                  (filter->operation == FILTER_GREATER)       ? compared >  filter->number :
+                                                                compared >= filter->number;
+    }
+
+    if (!matched)
+      return 0;
+  }
+
+  return 1;
+}
+
+
+/*************************************************************
+ * Add trimmed value to the column profile
+ *
+ *************************************************************/
+static void profile_value(struct columnProfile *profile, const char *value, size_t length,
+                          int left_aligned, int right_aligned, int profiling) {
+  int bucket;
+
+  profile->values++;
+
+  if (length == 1  &&  *value == '-') {
+    profile->nulls++;
+    return;
+  }
+
+  profile->leftAligned  += left_aligned;
+  profile->rightAligned += right_aligned;
+
+  if (profile->minLength == 0  ||  profile->minLength > length)
+    profile->minLength = length;
+
+  if (profile->maxLength < length)
+    profile->maxLength = length;
+
+  profile->totalLength += length;
+
+  bucket = 63 - clz64(length);
+  profile->widths[(bucket < PROFILE_WIDTH_BUCKETS) ? bucket : PROFILE_WIDTH_BUCKETS - 1]++;
+
+  if (profiling  &&  is_numeric(value, length))
+    profile->numeric++;
+}
+
+
+/*************************************************************
+ * Take non-empty value of the column into account: value
+ * 'first'..'last' (inclusive) of the column 'offset'..'end'
+ *************************************************************/
+static inline void analyze_value(struct rowsetAnalyzer *analyzer, long column, const char *line,
+                                 size_t offset, size_t end, size_t first, size_t last) {
+  long *leftPad = analyzer->leftPad, *rightPad = analyzer->rightPad;
+
+  if (leftPad[column] == -1 || leftPad[column] > (long)(first - offset))
+    leftPad[column] = first - offset;
+
+  if (rightPad[column] == -1  ||  rightPad[column] > (long)(end - 1 - last))
+    rightPad[column] = end - 1 - last;
+
+  profile_value(&analyzer->profile[column], line + first, last + 1 - first,
+                first == offset, last + 1 == end, analyzer->layout->profiling);
+
+  if (is_saturated(leftPad, rightPad, column))
+    analyzer->saturated++;
+}
+
+
+/*************************************************************
+ * Analyze non-ASCII row (--utf8). Row positions are taken from
+ * the row layout, values are scanned without the space mask.
+ *************************************************************/
+static int analyze_utf8_row(struct rowsetAnalyzer *analyzer, char *line, size_t length) {
+  struct columnLayout *layout = analyzer->layout, *row;
+  long   columnCount;
+  size_t offset, end, first, last;
+
+  if ((row = utf8_row_layout(layout, line, length)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return -1;
+  }
+
+  if (matches_layout(row, line, length, 0) != 0) {
+    if (invalid_row_state(line, length, 0) == 1) {
+      analyzer->state = 1;
+      return 0;
+    }
+
+    return -1;
+  }
+
+  if (row->filterCount != 0  &&  !matches_filters(row, line, length))
+    return 0;
+
+  for (columnCount = 0; columnCount < layout->count; columnCount++) {
+    if (!layout->profiling  &&  is_saturated(analyzer->leftPad, analyzer->rightPad, columnCount))
+      continue;
+
+    offset = row->offset[columnCount];
+    end    = offset + row->length[columnCount];
+
+    for (first = offset; first < end  &&  line[first] == ' '; first++)
+      ;
+
+    if (first == end) {
+      analyzer->profile[columnCount].empty++;
+      continue;
+    }
+
+    for (last = end - 1; line[last] == ' '; last--)
+      ;
+
+    analyze_value(analyzer, columnCount, line, offset, end, first, last);
+  }
+
+  return (analyzer->saturated == layout->count  &&  !layout->profiling) ? 2 : 0;
+}
+
+
+/*************************************************************
+ * Analyze next line of the rowset
+ * Returns:
+ *  0 - line is processed, next line is expected
+ *  1 - end of rowset is reached
+ *  2 - all columns are saturated, the rest of rowset doesn't
+ *      have to be analyzed
+ * -1 - non-DB2 output
+ *************************************************************/
+int analyze_row(struct rowsetAnalyzer *analyzer, char *line, size_t length) {
+  struct columnLayout *layout = analyzer->layout;
+  long *leftPad = analyzer->leftPad, *rightPad = analyzer->rightPad;
+  long columnCount;
+  size_t offset, end, first, last, word;
+  uint64_t *mask;
+
+  switch (analyzer->state) {
+    case 2:
+      return 1;
+
+    case 1:
+      // SQL error or warning. Skip non-relevant lines up to empty line.
+      if (length == 0)
+        analyzer->state = 0;
+
+      return 0;
+  }
+
+  // Check if it's the end of result set
+  if (length == 0) {
+    analyzer->state = 2;
+    return 1;
+  }
+
+  if (layout->utf8 == UTF8_CELLS  &&  !is_ascii(line, length))
+    return analyze_utf8_row(analyzer, line, length);
+
+  mask = analyzer->mask;
+  build_space_mask(line, (length < analyzer->maskEnd) ? length : analyzer->maskEnd, mask);
+
+  // Check separators
+  for (word = 0; word < analyzer->separatorWords; word++) {
+    if ((analyzer->separators[word] & ~mask[word]) != 0)
+      break;
+  }
+
+  if (length < analyzer->rowEnd  ||  word < analyzer->separatorWords) {
+    if (invalid_row_state(line, length, 0) == 1) {
+      analyzer->state = 1;
+      return 0;
+    }
+
+    return -1;
+  }
+
+  // Filtered out rows don't affect the output plan
+  if (layout->filterCount != 0  &&  !matches_filters(layout, line, length))
+    return 0;
+
+  for (columnCount = 0; columnCount < layout->count; columnCount++) {
+    if (!layout->profiling  &&  is_saturated(leftPad, rightPad, columnCount))
+      continue;
+
+    offset = layout->offset[columnCount];
+    end    = offset + layout->length[columnCount];
+
+    // Get left pad
+    if ((first = first_nonspace(mask, offset, end)) == end) {
+      // Empty value. Don't take it into account.
+      analyzer->profile[columnCount].empty++;
+      continue;
+    }
+
+    // Get right pad
+    last = last_nonspace(mask, end);
+
+    analyze_value(analyzer, columnCount, line, offset, end, first, last);
+  }
+
+  return (analyzer->saturated == layout->count  &&  !layout->profiling) ? 2 : 0;
+}
+
+
+/*************************************************************
+ * Parallel analysis of preloaded rowset
+ *
+ * Lines are split into chunks, each chunk is analyzed by its
+ * own thread with private pads arrays. Chunks are analyzed as if
+ * they start with a rowset row. Results are merged in the input
+ * order: if an SQL message crosses chunk boundary, the next
+ * chunk is analyzed once again starting in the SQL message
+ * state. Chunks after the end of rowset are ignored.
+ *************************************************************/
+struct analysisChunk {
+  struct formatterContext *context;
+  struct columnLayout *layout;
+  long                *pads;        // Private left pads followed by right pads and profile
+  struct inputLine    *lines;
+  long                 lineCount;
+  int                  initialState;
+  int                  endState;
+  int                  result;      // See analyze_row()
+  pthread_t            thread;
+};
+
+
+static void *analyzer_thread(void *argument) {
+  struct analysisChunk *chunk = argument;
+  struct rowsetAnalyzer analyzer;
+  long count;
+
+  enter_context(chunk->context);
+
+  if (init_analyzer(&analyzer, chunk->layout) != 0) {
+    chunk->result = -1;
+    return NULL;
+  }
+
+  for (count = 0; count < chunk->layout->count*2; count++)
+    chunk->pads[count] = -1;
+
+  analyzer.leftPad   = chunk->pads;
+  analyzer.rightPad  = chunk->pads + chunk->layout->count;
+  analyzer.profile   = (struct columnProfile *)(chunk->pads + chunk->layout->count*2);
+  memset(analyzer.profile, 0, chunk->layout->count*sizeof(struct columnProfile));
+  analyzer.saturated = 0;
+  analyzer.state     = chunk->initialState;
+  chunk->result      = 0;
+
+  for (count = 0; count < chunk->lineCount; count++) {
+    if ((chunk->result = analyze_row(&analyzer, chunk->lines[count].data, chunk->lines[count].length)) != 0)
+      break;
+  }
+
+  chunk->endState = analyzer.state;
+  free_analyzer(&analyzer);
+  free_utf8_row();
+
+  return NULL;
+}
+
+
+/*************************************************************
+ * Merge pads and profile collected by the chunk into the layout
+ *
+ *************************************************************/
+static void merge_pads(struct columnLayout *layout, const long *pads) {
+  const long *leftPad = pads, *rightPad = pads + layout->count;
+  const struct columnProfile *profile = (const struct columnProfile *)(pads + layout->count*2);
+  struct columnProfile *total;
+  int bucket;
+
+  for (long count = 0; count < layout->count; count++) {
+    if (leftPad[count] != -1  &&  (layout->leftPad[count] == -1  ||  layout->leftPad[count] > leftPad[count]))
+      layout->leftPad[count] = leftPad[count];
+
+    if (rightPad[count] != -1  &&  (layout->rightPad[count] == -1  ||  layout->rightPad[count] > rightPad[count]))
+      layout->rightPad[count] = rightPad[count];
+
+    total = &layout->profile[count];
+
+    total->values       += profile[count].values;
+    total->empty        += profile[count].empty;
+    total->nulls        += profile[count].nulls;
+    total->numeric      += profile[count].numeric;
+    total->leftAligned  += profile[count].leftAligned;
+    total->rightAligned += profile[count].rightAligned;
+    total->totalLength  += profile[count].totalLength;
+
+    if (profile[count].minLength != 0  &&  (total->minLength == 0  ||  total->minLength > profile[count].minLength))
+      total->minLength = profile[count].minLength;
+
+    if (total->maxLength < profile[count].maxLength)
+      total->maxLength = profile[count].maxLength;
+
+    for (bucket = 0; bucket < PROFILE_WIDTH_BUCKETS; bucket++)
+      total->widths[bucket] += profile[count].widths[bucket];
+  }
+}
+
+
+/*************************************************************
+ * Analyze 'lineCount' lines in 'threads' threads starting in
+ * 'initial_state' (see rowsetAnalyzer)
+ * Returns 0 on success, -1 for non-DB2 output, -2 if threads
+ * can't be started
+ *************************************************************/
+int analyze_lines_threaded(struct columnLayout *layout, struct inputLine *lines, long lineCount, int initial_state, int threads) {
+  struct analysisChunk chunks[threads];
+  long   chunkLines = (lineCount + threads - 1)/threads;
+  int    count, started, state, result;
+
+  for (started = 0; started < threads  &&  started*chunkLines < lineCount; started++) {
+    chunks[started].context      = context;
+    chunks[started].layout       = layout;
+    chunks[started].lines        = lines + started*chunkLines;
+    chunks[started].lineCount    = (lineCount - started*chunkLines < chunkLines) ? lineCount - started*chunkLines : chunkLines;
+    chunks[started].initialState = (started == 0) ? initial_state : 0;
+
+    if ((chunks[started].pads = fmt_malloc(layout->count*(2*sizeof(long) + sizeof(struct columnProfile)))) == NULL)
+      break;
+
+    if (pthread_create(&chunks[started].thread, NULL, analyzer_thread, &chunks[started]) != 0) {
+      fmt_free(chunks[started].pads);
+      break;
+    }
+  }
+
+  for (count = 0; count < started; count++)
+    pthread_join(chunks[count].thread, NULL);
+
+  if (started*chunkLines < lineCount) {
+    // Not all threads are started
+    for (count = 0; count < started; count++)
+      fmt_free(chunks[count].pads);
+
+    return -2;
+  }
+
+  // Merge chunk results in the input order
+  state  = 0;
+  result = 0;
+
+  for (count = 0; count < started; count++) {
+    if (result == 0  &&  state != 0) {
+      // SQL message crosses the chunk boundary, analyze chunk once again
+      chunks[count].initialState = state;
+
+      analyzer_thread(&chunks[count]);
+    }
+
+    if (result == 0) {
+      merge_pads(layout, chunks[count].pads);
+
+      result = chunks[count].result;
+      state  = chunks[count].endState;
+    }
+
+    fmt_free(chunks[count].pads);
+  }
+
+  return (result == -1) ? -1 : 0;
+}
+
+
+/*************************************************************
+ * Analyze 'lineCount' preloaded lines (pass 1) starting in
+ * 'state' (see rowsetAnalyzer)
+ * Returns 0 on success, -1 for non-DB2 output
+ *************************************************************/
+int analyze_rowset(struct columnLayout *layout, struct inputLine *lines, long lineCount, int state, int threads) {
+  struct rowsetAnalyzer analyzer;
+  long count;
+  int  result = 0;
+
+  if (threads > lineCount/MIN_ANALYSIS_CHUNK_LINES)
+    threads = lineCount/MIN_ANALYSIS_CHUNK_LINES;
+
+  if (threads > 1  &&  (result = analyze_lines_threaded(layout, lines, lineCount, state, threads)) != -2)
+    return result;
+
+  if (init_analyzer(&analyzer, layout) != 0)
+    return -1;
+
+  analyzer.state = state;
+
+  // Iterate through lines to get left/right padding info
+  for (count = 0; count < lineCount; count++) {
+    if ((result = analyze_row(&analyzer, lines[count].data, lines[count].length)) != 0)
+      break;
+  }
+
+  free_analyzer(&analyzer);
+
+  return (result == -1) ? -1 : 0;
+}
+
+
+/*************************************************************
+ * Load and analyze resultset: header lines followed by rows up
+ * to the end of rowset (inclusive), 'sample_size' lines or the
+ * end of input. Rows filtered out by --where aren't counted in
+ * the sample. Rows are analyzed as they are loaded, loading
+ * stops early when all columns are saturated. Analysis result
+ * (see analyze_rowset()) is stored to 'analysis'.
+ * Loaded lines are retained by the input reader and have to be
+ * freed with releaseLines(). The end of lines list is marked
+ * by a line with NULL data.
+ *************************************************************/
+struct inputLine *getInput(struct columnLayout *layout, struct resultsetHeader *header, int sample_size, int threads, int *analysis) {
+  struct inputLine *inputLines, *_inputLines;
+  unsigned long input_buffer_size;
+  unsigned long lines, analyzed, filtered = 0;
+  int state = 0, previous_state, analyzed_state = 0, end = 0;
+  double started;
+
+  inputLines        = NULL;
+  input_buffer_size = INITIAL_LINES_CONTAINER_SIZE;
+  lines             = 2;
+  analyzed          = 2;
+
+  retainLines(INPUT);
+
+  while (1) {
+    started = stats_clock();
+
+    // Allocate/reallocate memory
+    if ( (_inputLines = fmt_realloc(inputLines, input_buffer_size*(sizeof(struct inputLine)))) == NULL ) {
+      releaseLines(INPUT);
+
+      fmt_free(inputLines);
+      fprintf(stderr, "Not enough memory or memory allocation error\n");
+
+      return NULL;
+    }
+    inputLines = _inputLines;
+
+    inputLines[0] = header->lines[0];
+    inputLines[1] = header->lines[1];
+
+    while ( lines < input_buffer_size - 1  &&  (( lines - filtered < sample_size) || (sample_size == -1))  &&  state != -1 ) {
+      if ((inputLines[lines].data = getLine(INPUT, &inputLines[lines].length)) == NULL) {
+        end = 1;
+        break;
+      }
+
+      previous_state = state;
+      state = next_row_state(layout, inputLines[lines].data, inputLines[lines].length, state);
+
+      // Filtered out rows aren't counted in the sample
+      if (previous_state == 0  &&  state == 0  &&  layout->filterCount != 0  &&  sample_size != -1  &&
+          !matches_filters(layout, inputLines[lines].data, inputLines[lines].length))
+        filtered++;
+
+      lines++;
+    }
+
+    inputLines[lines].data = NULL; // End of input marker
+    stats_phase(PHASE_GET_INPUT, started);
+
+    // Analyze just loaded lines (pass 1)
+    started   = stats_clock();
+    *analysis = analyze_rowset(layout, inputLines + analyzed, lines - analyzed, analyzed_state, threads);
+    stats_phase(PHASE_ANALYZE_ROWSET, started);
+
+    analyzed       = lines;
+    analyzed_state = state;
+
+    if ( end  ||  (sample_size != -1  &&  lines - filtered >= sample_size)  ||  state == -1  ||
+         *analysis != 0  ||  (!layout->profiling  &&  count_saturated(layout) == layout->count) ) {
+      return inputLines;
+    }
+
+    input_buffer_size *= 2;
+  }
+}
+
+
+/*************************************************************
+ * Check if values of the column are right justified: all of
+ * them end at the column end and some don't start at the column
+ * start. Pads are compared if there are no non-NULL values.
+ *************************************************************/
+static int is_right_justified(struct columnLayout *layout, long column) {
+  const struct columnProfile *profile = &layout->profile[column];
+  unsigned long values = profile->values - profile->nulls;
+
+  if (values == 0)
+    return layout->leftPad[column] > layout->rightPad[column];
+
+  return profile->rightAligned == values  &&  profile->leftAligned < values;
+}
+
+
+/*************************************************************
+ * Prepare output plan of the columns from the collected pads
+ *
+ *************************************************************/
+static void plan_columns(struct columnLayout *layout) {
+  struct columnName *name;
+  long count;
+
+  layout->rowLength = 0;
+
+  // Output plan
+  for (count = 0; count < layout->count; count++) {
+    name = &(layout->names[count]);
+
+    layout->rightJustified[count] = 0;
+
+    if (layout->leftPad[count] == -1) {
+      // Empty column
+      layout->length[count]     = name->nameLength;
+      layout->printWidth[count] = name->nameLength;
+
+    } else if (name->nameLength <= layout->length[count] - (layout->leftPad[count] + layout->rightPad[count]) ) {
+      // Value is longer or equal than column name
+      layout->offset[count] += layout->leftPad[count];
+      layout->length[count] -= (layout->leftPad[count] + layout->rightPad[count]);
+      layout->printWidth[count] = layout->length[count];
+
+    } else {
+      // Name is longer than column values
+      layout->offset[count] += layout->leftPad[count];
+      layout->length[count] -= (layout->leftPad[count] + layout->rightPad[count]);
+      layout->printWidth[count] = name->nameLength;
+
+      if (is_right_justified(layout, count)) {
+        // Special case, values are right justified
+        layout->rightJustified[count] = 1;
+      }
+    }
+
+    layout->rowLength += layout->printWidth[count] + 1;
+  }
+
+  // Columns are already tight and aren't projected or filtered,
+  // formatting doesn't change rows
+  for (count = 0; count < layout->count; count++) {
+    if (layout->offset[count] != layout->inputOffset[count]  ||  layout->length[count] != layout->inputLength[count]  ||
+        layout->printWidth[count] != layout->length[count]  ||
+        layout->inputOffset[count] != ((count == 0) ? 0 : layout->inputOffset[count - 1] + layout->inputLength[count - 1] + 1))
+      break;
+  }
+  layout->passthrough = (count == layout->count  &&  layout->count > 0  &&  layout->rowLength - 1 == layout->inputEnd  &&
+                         layout->filterCount == 0);
+}
+
+
+/*************************************************************
+ * Print column names and delimiters according to output plan
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+static int print_header(struct columnLayout *layout) {
+  long count;
+  char *out;
+
+  if ((out = outputReserve(OUTPUT, layout->rowLength*2)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return -1;
+  }
+
+  // Column names
+  for (count = 0; count < layout->count; count++) {
+    memcpy(out, layout->names[count].name, layout->names[count].nameLength);
+    memset(out + layout->names[count].nameLength, ' ', layout->printWidth[count] - layout->names[count].nameLength);
+
+    out   += layout->printWidth[count];
+    *out++ = (count + 1 == layout->count) ? '\n' : ' ';
+  }
+
+  // Delimiters
+  for (count = 0; count < layout->count; count++) {
+    memset(out, '-', layout->printWidth[count]);
+
+    out   += layout->printWidth[count];
+    *out++ = (count + 1 == layout->count) ? '\n' : ' ';
+  }
+
+  outputCommit(OUTPUT, layout->rowLength*2);
+
+  return 0;
+}
+
+
+/**********************************************************************************
+ * Process header
+ * Prepares output plan of the columns and prints header
+ * Returns 0 on success, -1 on memory allocation error
+ **********************************************************************************/
+int process_header(struct columnLayout *layout) {
+  layout->passthrough = 0;
+
+  // Other formats print trimmed values, output plan isn't used
+  if (OUTPUT->format == OUTPUT_FORMAT_COLUMNAR) {
+    columnar_schema(OUTPUT, layout);
+    return 0;
+  } else if (OUTPUT->format != OUTPUT_FORMAT_TEXT) {
+    return delimited_header(OUTPUT, layout);
+  }
+
+  plan_columns(layout);
+
+  return print_header(layout);
+}
+
+/*************************************************************
+ * Print profile of the analyzed values (--profile)
+ *
+ *************************************************************/
+void print_profile(struct columnLayout *layout) {
+  const struct columnProfile *profile;
+  unsigned long values;
+  long count;
+  int  bucket;
+
+  fprintf(stderr, "Profile of resultset %lu:\n", context->stats.resultsets);
+  fprintf(stderr, "  %-30s %12s %12s %12s %12s %8s %8s %8s %-8s %s\n",
+          "column", "values", "empty", "nulls", "numeric", "min", "max", "avg", "justify", "widths");
+
+  for (count = 0; count < layout->count; count++) {
+    profile = &layout->profile[count];
+    values  = profile->values - profile->nulls;
+
+    fprintf(stderr, "  %-30s %12lu %12lu %12lu %12lu %8zu %8zu %8.1f %-8s",
+            layout->names[count].name, profile->values, profile->empty, profile->nulls, profile->numeric,
+            profile->minLength, profile->maxLength, (values != 0) ? (double)profile->totalLength/values : 0.0,
+            (values == 0) ? "-" : is_right_justified(layout, count) ? "right" : "left");
+
+    for (bucket = 0; bucket < PROFILE_WIDTH_BUCKETS; bucket++) {
+      if (profile->widths[bucket] == 0)
+        continue;
+
+      if (bucket == 0)
+        fprintf(stderr, " 1:%lu", profile->widths[bucket]);
+      else if (bucket == PROFILE_WIDTH_BUCKETS - 1)
+        fprintf(stderr, " %lu+:%lu", 1UL << bucket, profile->widths[bucket]);
+      else
+        fprintf(stderr, " %lu-%lu:%lu", 1UL << bucket, (2UL << bucket) - 1, profile->widths[bucket]);
+    }
+
+    fprintf(stderr, "\n");
+  }
+}
+
+
+/*************************************************************
+ * Widen output plan of the columns which can't hold the row
+ * values (--incremental=header). Header is printed once again
+ * if columns become wider. Row positions are taken from 'row'
+ * (see utf8_row_layout()), it's 'layout' for ASCII rows.
+ * Returns 0 on success, -1 on memory allocation error
+ *************************************************************/
+int reflow_plan(struct columnLayout *layout, struct columnLayout *row, const char *line, size_t length) {
+  size_t offset, end, first, last, rowLength;
+  long   count, widened = 0;
+
+  for (count = 0; count < layout->count; count++) {
+    if (!layout->checkOverflow[count]  ||  !is_overflow(row, count, line, length))
+      continue;
+
+    offset = row->inputOffset[count];
+    end    = offset + input_length(row, count, length);
+
+    for (first = offset; line[first] == ' '; first++)
+      ;
+
+    for (last = end; line[last - 1] == ' '; last--)
+      ;
+
+    if (layout->leftPad[count] == -1  ||  layout->leftPad[count] > (long)(first - offset))
+      layout->leftPad[count] = first - offset;
+
+    if (layout->rightPad[count] == -1  ||  layout->rightPad[count] > (long)(offset + row->inputLength[count] - last))
+      layout->rightPad[count] = offset + row->inputLength[count] - last;
+
+    widened++;
+  }
+
+  if (widened == 0)
+    return 0;
+
+  // Output plan is computed from the input layout
+  memcpy(layout->offset, layout->inputOffset, layout->count*sizeof(size_t));
+  memcpy(layout->length, layout->inputLength, layout->count*sizeof(size_t));
+
+  rowLength = layout->rowLength;
+  plan_columns(layout);
+  enable_overflow_check(layout);
+
+  // Values may still fit into the column names width
+  return (layout->rowLength != rowLength) ? print_header(layout) : 0;
+}
+
+
+/*************************************************************
+ * Flush row
  * Returns current state of processing:
  *  1  - next line is a part of SQL warning/error message 
  *       in the middle of resultset
  *  0  - next line is a common rowset row
  * -1  - rowset processing is completed
  *************************************************************/
-int process_row(struct columnDescription *columns, char *line, int state) {
-  switch (state) {
-    case 1:
-      // SQL error or warning processing
-      if (line[0] == 0) {
-        // Empty line (end of SQL warning/error marker)
-        state = 0;
-      }
+int process_row(struct columnLayout *layout, char *line, size_t length, int state, struct outputBuffer *output, unsigned long *overflows) {
+  struct columnLayout *row;
+
+  switch (state) {
+    case 1:
+      // SQL error or warning processing
+      if (length == 0) {
+        // Empty line (end of SQL warning/error marker)
+        state = 0;
+      }
+
+      record_output(output, RECORD_MESSAGE, length + 1);
+      outputLine(output, line, length);
+
+      return state;
+
+    case 0:
+      // Non-ASCII rows have their own byte positions
+      if (layout->utf8 == UTF8_CELLS  &&  !is_ascii(line, length)) {
+        if ((row = utf8_row_layout(layout, line, length)) == NULL) {
+          fprintf(stderr, "Not enough memory or memory allocation error\n");
+          outputLine(output, line, length);
+          return -1;
+        }
+      } else {
+        row = layout;
+      }
+
+      if ( (state = matches_layout(row, line, length, state)) == 0 ) {
+        if (row->filterCount != 0  &&  !matches_filters(row, line, length)) {
+          output->filtered++;
+          return state;
+        }
+
+        if (layout->reflow) {
+          if (reflow_plan(layout, row, line, length) != 0) {
+            fprintf(stderr, "Not enough memory or memory allocation error\n");
+            return state;
+          }
+
+          // Output plan may be changed
+          if (row != layout  &&  (row = utf8_row_layout(layout, line, length)) == NULL) {
+            fprintf(stderr, "Not enough memory or memory allocation error\n");
+            return state;
+          }
+        }
+
+        print_row(row, line, length, output, overflows);
+      } else {
+        record_output(output, (state == 1) ? RECORD_MESSAGE : RECORD_END, length + 1);
+        outputLine(output, line, length);
+      }
+
+      return state;
+
+    case -1:
+      // Non-resultset lines processing
+      outputLine(output, line, length);
+
+      return -1;
+  }
+
+  return -1;
+}
+
+/*************************************************************
+ * Multi-threaded rowset processing
+ *
+ * Calling thread reads lines and splits them into batches,
+ * formatter threads process batches in parallel and writer
+ * thread prints them in the input order.
+ * Calling thread tracks processing state line by line, so each
+ * batch is formatted starting with the actual state and input
+ * isn't read beyond the end of rowset.
+ *************************************************************/
+struct lineBatch {
+  struct lineBatch   *next;
+  unsigned long       sequence;
+  struct inputLine    lines[BATCH_MAX_LINES];
+  size_t              lineCount;
+  char               *data;          // Copy of lines data if input lines aren't stable
+  size_t              dataSize;
+  size_t              dataUsed;
+  struct outputBuffer output;        // Formatted lines
+  struct outputBuffer messages;      // Non-resultset lines of delimited formats
+  unsigned long      *overflows;     // Per column counters of values wider than the output plan
+  int                 startState;    // Processing state before the first line
+};
+
+struct batchQueue {
+  struct lineBatch *head;
+  struct lineBatch *tail;
+  int               closed;
+  pthread_cond_t    cond;
+};
+
+struct rowsetPipeline {
+  struct formatterContext *context;
+  struct columnLayout *layout;
+  pthread_mutex_t    mutex;          // Protects all queues
+  struct batchQueue  freeBatches;
+  struct batchQueue  work;
+  struct batchQueue  done;
+  unsigned long     *overflows;
+};
+
+
+static void queue_push(struct rowsetPipeline *pipeline, struct batchQueue *queue, struct lineBatch *batch) {
+  pthread_mutex_lock(&pipeline->mutex);
+
+  batch->next = NULL;
+  if (queue->tail != NULL)
+    queue->tail->next = batch;
+  else
+    queue->head = batch;
+  queue->tail = batch;
+
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+}
+
+
+static void queue_close(struct rowsetPipeline *pipeline, struct batchQueue *queue) {
+  pthread_mutex_lock(&pipeline->mutex);
+
+  queue->closed = 1;
+
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+}
+
+
+/*************************************************************
+ * Take batch from the queue. If 'sequence' isn't -1, waits for
+ * the batch with this sequence number.
+ * Returns NULL if queue is closed and has no such batch.
+ *************************************************************/
+static struct lineBatch *queue_take(struct rowsetPipeline *pipeline, struct batchQueue *queue, long sequence) {
+  struct lineBatch *batch, *previous;
+
+  pthread_mutex_lock(&pipeline->mutex);
+
+  while (1) {
+    for (previous = NULL, batch = queue->head; batch != NULL; previous = batch, batch = batch->next) {
+      if (sequence == -1  ||  batch->sequence == (unsigned long)sequence)
+        break;
+    }
+
+    if (batch != NULL  ||  queue->closed)
+      break;
+
+    pthread_cond_wait(&queue->cond, &pipeline->mutex);
+  }
+
+  if (batch != NULL) {
+    if (previous != NULL)
+      previous->next = batch->next;
+    else
+      queue->head = batch->next;
+
+    if (queue->tail == batch)
+      queue->tail = previous;
+  }
+
+  pthread_mutex_unlock(&pipeline->mutex);
+
+  return batch;
+}
+
+
+static void *formatter_thread(void *argument) {
+  struct rowsetPipeline *pipeline = argument;
+  struct lineBatch *batch;
+  size_t count;
+  int    state;
+
+  enter_context(pipeline->context);
+
+  while ((batch = queue_take(pipeline, &pipeline->work, -1)) != NULL) {
+    batch->output.used     = 0;
+    batch->output.filtered = 0;
+    batch->messages.used   = 0;
+    memset(batch->overflows, 0, OVERFLOW_COUNTERS(pipeline->layout->count)*sizeof(unsigned long));
+
+    for (count = 0, state = batch->startState; count < batch->lineCount; count++) {
+      state = process_row(pipeline->layout, batch->lines[count].data, batch->lines[count].length, state,
+                          &batch->output, batch->overflows);
+    }
+
+    // Rows of the batch make its own record batch
+    columnar_flush(&batch->output);
+
+    queue_push(pipeline, &pipeline->done, batch);
+  }
+
+  free_utf8_row();
+
+  return NULL;
+}
+
+
+static void *writer_thread(void *argument) {
+  struct rowsetPipeline *pipeline = argument;
+  struct lineBatch *batch;
+  long   sequence;
+
+  enter_context(pipeline->context);
+
+  for (sequence = 0; (batch = queue_take(pipeline, &pipeline->done, sequence)) != NULL; sequence++) {
+    move_records(OUTPUT, &batch->output, output_position(OUTPUT));
+    outputWrite(OUTPUT, batch->output.data, batch->output.used);
+    OUTPUT->filtered += batch->output.filtered;
+
+    if (batch->messages.used != 0)
+      outputWrite(OUTPUT->messages, batch->messages.data, batch->messages.used);
+
+    if (pipeline->overflows != NULL)
+      merge_overflows(pipeline->layout->count, pipeline->overflows, batch->overflows);
+
+    queue_push(pipeline, &pipeline->freeBatches, batch);
+  }
+
+  return NULL;
+}
+
+
+/*************************************************************
+ * Add line to the batch. Lines which aren't stable (are valid
+ * only until the next getLine() call) are copied to the batch.
+ * Returns 0 on success, -1 if line doesn't fit into the batch
+ *************************************************************/
+static int batch_add_line(struct lineBatch *batch, char *line, size_t length, int stable) {
+  if (batch->lineCount == BATCH_MAX_LINES)
+    return -1;
+
+  if (!stable) {
+    if (batch->dataSize - batch->dataUsed < length) {
+      char *data;
+
+      // Batch is full, the line starts the next one
+      if (batch->lineCount != 0)
+        return -1;
+
+      // Line is longer than the buffer, grow it
+      if ((data = fmt_realloc(batch->data, length)) == NULL)
+        return -1;
+
+      batch->data     = data;
+      batch->dataSize = length;
+    }
+
+    line = memcpy(batch->data + batch->dataUsed, line, length);
+    batch->dataUsed += length;
+  }
+
+  batch->lines[batch->lineCount].data   = line;
+  batch->lines[batch->lineCount].length = length;
+  batch->lineCount++;
+
+  return 0;
+}
+
+
+static void free_batches(struct lineBatch *batch) {
+  struct lineBatch *next;
+
+  for (; batch != NULL; batch = next) {
+    next = batch->next;
+
+    closeColumnarOutput(&batch->output, 0);
+    fmt_free(batch->data);
+    fmt_free(batch->output.data);
+    fmt_free(batch->output.records.items);
+    fmt_free(batch->messages.data);
+    fmt_free(batch->overflows);
+    fmt_free(batch);
+  }
+}
+
+
+/*************************************************************
+ * Process lines from 'lines' array (if it's not NULL) and then
+ * from 'reader' (if it's not NULL) up to the end of rowset using
+ * 'threads' formatter threads.
+ * Returns processing state (see process_row()) or -2 if threads
+ * can't be started.
+ *************************************************************/
+int process_lines_threaded(struct columnLayout *layout, struct inputLine *lines, struct lineReader *reader,
+                           int processing_state, unsigned long *overflows, int threads) {
+  struct rowsetPipeline pipeline = { .context = context, .layout = layout, .overflows = overflows };
+  struct lineBatch *batch, *allBatches = NULL;
+  pthread_t  formatters[threads], writer;
+  int        count, started = 0, stable, previous_state;
+  char      *line = NULL;
+  size_t     length = 0;
+  unsigned long sequence;
+
+  for (count = 0; count < threads*2 + 2; count++) {
+    if ( (batch = fmt_calloc(1, sizeof(struct lineBatch))) == NULL ) {
+      free_batches(allBatches);
+      return -2;
+    }
+
+    batch->next = allBatches;
+    allBatches  = batch;
+
+    if ( (batch->overflows = fmt_calloc(OVERFLOW_COUNTERS(layout->count), sizeof(unsigned long))) == NULL  ||
+         (batch->data = fmt_malloc(BATCH_DATA_SIZE)) == NULL  ||
+         openOutputBuffer(&batch->output, BATCH_DATA_SIZE*2, OUTPUT_MODE_MEMORY) != 0  ||
+         (OUTPUT->columnar != NULL  &&  openColumnarOutput(&batch->output, layout->count) != 0)  ||
+         (OUTPUT->messages != NULL  &&  openOutputBuffer(&batch->messages, INPUT_BLOCK_SIZE, OUTPUT_MODE_MEMORY) != 0) ) {
+      free_batches(allBatches);
+      return -2;
+    }
+
+    batch->dataSize               = BATCH_DATA_SIZE;
+    batch->output.format          = OUTPUT->format;
+    batch->output.records.enabled = OUTPUT->records.enabled;
+    if (OUTPUT->messages != NULL)
+      batch->output.messages = &batch->messages;
+  }
+
+  // Writer adds formatted batches to the output as is, rows collected
+  // before have to be written first
+  columnar_flush(OUTPUT);
+
+  pthread_mutex_init(&pipeline.mutex, NULL);
+  pthread_cond_init(&pipeline.freeBatches.cond, NULL);
+  pthread_cond_init(&pipeline.work.cond, NULL);
+  pthread_cond_init(&pipeline.done.cond, NULL);
+
+  while ((batch = allBatches) != NULL) {
+    allBatches = batch->next;
+    queue_push(&pipeline, &pipeline.freeBatches, batch);
+  }
+
+  for (started = 0; started < threads; started++) {
+    if (pthread_create(&formatters[started], NULL, formatter_thread, &pipeline) != 0)
+      break;
+  }
+
+  if (started == 0  ||  pthread_create(&writer, NULL, writer_thread, &pipeline) != 0) {
+    queue_close(&pipeline, &pipeline.work);
+    for (count = 0; count < started; count++)
+      pthread_join(formatters[count], NULL);
+
+    free_batches(pipeline.freeBatches.head);
+    return -2;
+  }
+
+
+  // Split input into batches
+  for (sequence = 0; processing_state != -1; sequence++) {
+    batch = queue_take(&pipeline, &pipeline.freeBatches, -1);
+
+    batch->sequence   = sequence;
+    batch->lineCount  = 0;
+    batch->output.records.count = 0;
+    batch->dataUsed   = 0;
+    batch->startState = processing_state;
+
+    while (processing_state != -1) {
+      if (line == NULL) {
+        // Get next line. Preloaded and mapped lines stay valid, so they
+        // aren't copied.
+        if (lines != NULL  &&  lines->data != NULL) {
+          line   = lines->data;
+          length = lines->length;
+          stable = 1;
+          lines++;
+        } else if (reader != NULL  &&  (line = getLine(reader, &length)) != NULL) {
+          stable = (reader->map != NULL);
+        } else {
+          break;
+        }
+      }
+
+      if (batch_add_line(batch, line, length, stable) != 0)
+        break;
+
+      previous_state   = processing_state;
+      processing_state = next_row_state(layout, line, length, processing_state);
+      stats_line(previous_state, processing_state);
+      line = NULL;
+    }
+
+    if (batch->lineCount == 0) {
+      if (line != NULL)
+        fprintf(stderr, "Not enough memory or memory allocation error\nPartial input processing\n");
+
+      queue_push(&pipeline, &pipeline.freeBatches, batch);
+      break;
+    }
+
+    context->stats.batches++;
+    context->stats.batchLines += batch->lineCount;
+    queue_push(&pipeline, &pipeline.work, batch);
+  }
+
+
+  // Wait for all batches to be printed
+  queue_close(&pipeline, &pipeline.work);
+  for (count = 0; count < started; count++)
+    pthread_join(formatters[count], NULL);
+
+  queue_close(&pipeline, &pipeline.done);
+  pthread_join(writer, NULL);
+
+  free_batches(pipeline.freeBatches.head);
+
+  pthread_cond_destroy(&pipeline.freeBatches.cond);
+  pthread_cond_destroy(&pipeline.work.cond);
+  pthread_cond_destroy(&pipeline.done.cond);
+  pthread_mutex_destroy(&pipeline.mutex);
+
+  return processing_state;
+}
+
+
+/*************************************************************
+ * Flush preloaded rowset
+ * Returns current state of output processing:
+ *  1  - next line is a part of SQL warning/error message 
+ *       in the middle of resultset
+ *  0  - next line is a common rowset row
+ * -1  - rowset processing is completed
+ *************************************************************/
+int process_rowset_preloaded(struct columnLayout *layout, struct inputLine *lines, unsigned long *overflows, int threads) {
+  long count;
+  int processing_state = 0, previous_state;
+
+  if (threads > 0  &&  (processing_state = process_lines_threaded(layout, lines + 2, NULL, 0, overflows, threads)) != -2)
+    return processing_state;
+
+  processing_state = 0;
+
+  // Iterate through lines
+  for (count = 2; lines[count].data != NULL; count++) {
+    previous_state   = processing_state;
+    processing_state = process_row(layout, lines[count].data, lines[count].length, processing_state, OUTPUT, overflows);
+    stats_line(previous_state, processing_state);
+  }
+
+  return processing_state;
+}
+
+
+/*************************************************************
+ * Write part of mapped input file to output. Long parts are
+ * sent by the kernel without copying them to the output buffer.
+ *************************************************************/
+static void outputInput(struct outputBuffer *out, struct lineReader *reader, const char *data, size_t length) {
+  off_t   offset = data - reader->map;
+  ssize_t result;
+
+  if (length >= MIN_SENDFILE_LENGTH  &&  out->mode != OUTPUT_MODE_MEMORY  &&  out->columnar == NULL  &&  out->sink == NULL) {
+    flushOutput(out);
+
+    while (length > 0  &&  !out->error) {
+      if ((result = sendfile(out->fd, reader->fd, &offset, length)) <= 0) {
+        if (result < 0  &&  errno == EINTR)
+          continue;
+
+        // Output doesn't support sendfile(), write the rest as usual
+        break;
+      }
+
+      data   += result;
+      length -= result;
+      out->written += result;
+    }
+  }
+
+  if (length > 0)
+    outputWrite(out, data, length);
+}
+
+
+/*************************************************************
+ * Copy rows which are printed as is (see process_header())
+ * straight from the mapped input file to output up to the first
+ * line which has to be processed by process_row()
+ *************************************************************/
+static void passthrough_rows(struct columnLayout *layout, struct lineReader *reader) {
+  size_t width = layout->rowLength - 1;
+  char  *start = reader->position;
+
+  while ((size_t)(reader->end - reader->position) > width  &&  reader->position[width] == '\n'  &&
+         is_valid_row(layout, reader->position, width, 0) == 0) {
+    reader->position += width + 1;
+    reader->lines++;
+    reader->bytes += width + 1;
+    stats_line(0, 0);
+  }
+
+  if (reader->position != start)
+    outputInput(OUTPUT, reader, start, reader->position - start);
+}
+
+
+/*************************************************************
+ * Chunked processing of mapped input
+ *
+ * The rest of mapped rowset is split into newline aligned chunks
+ * which are formatted in parallel, each chunk into its own
+ * buffer. All chunks except the first one are formatted as if
+ * they start with a row; the state is resolved when chunks are
+ * merged in the input order: a chunk which actually starts in
+ * the middle of SQL message is formatted once again and chunks
+ * after the end of rowset are discarded. Formatted chunks are
+ * written with one writev(2).
+ *************************************************************/
+struct mappedChunk {
+  struct formatterContext *context;
+  struct columnLayout *layout;
+  pthread_t           thread;
+  int                 started;       // Thread is started
+  char               *start;         // Chunk lines
+  char               *end;
+  char               *stop;          // End of processed lines
+  int                 startState;    // Processing state before the first line
+  int                 endState;
+  struct outputBuffer output;
+  unsigned long      *overflows;
+  unsigned long       lines;         // Statistics of the processed lines
+  unsigned long long  bytes;
+  unsigned long       rows;
+  unsigned long       messageLines;
+};
+
+
+static void *chunk_thread(void *argument) {
+  struct mappedChunk *chunk = argument;
+  char  *line, *eol;
+  size_t length;
+  int    state, previous_state;
+
+  enter_context(chunk->context);
+
+  chunk->output.used          = 0;
+  chunk->output.filtered      = 0;
+  chunk->output.records.count = 0;
+  chunk->lines        = 0;
+  chunk->bytes        = 0;
+  chunk->rows         = 0;
+  chunk->messageLines = 0;
+  memset(chunk->overflows, 0, OVERFLOW_COUNTERS(chunk->layout->count)*sizeof(unsigned long));
+
+  for (line = chunk->start, state = chunk->startState; line < chunk->end  &&  state != -1; ) {
+    eol    = memchr(line, '\n', chunk->end - line);
+    length = (eol != NULL) ? (size_t)(eol - line) : (size_t)(chunk->end - line);
+
+    previous_state = state;
+    state = process_row(chunk->layout, line, length, state, &chunk->output, chunk->overflows);
+
+    if (previous_state == 0  &&  state == 0)
+      chunk->rows++;
+    else if (previous_state == 1  ||  state == 1)
+      chunk->messageLines++;
+
+    line += length + (eol != NULL);
+    chunk->lines++;
+    chunk->bytes += length + (eol != NULL);
+  }
+
+  chunk->stop     = line;
+  chunk->endState = state;
+  free_utf8_row();
+
+  return NULL;
+}
+
+
+/*************************************************************
+ * Process the rest of mapped rowset in chunks using 'threads'
+ * threads (see mappedChunk)
+ * Returns processing state (see process_row()) or -2 if chunk
+ * buffers can't be allocated
+ *************************************************************/
+int process_mapped_chunks(struct columnLayout *layout, struct lineReader *reader, int processing_state,
+                          unsigned long *overflows, int threads) {
+  struct mappedChunk chunks[threads];
+  struct iovec blocks[threads];
+  char  *start, *eol;
+  int    count, chunkCount, merged, allocated;
+  unsigned long long offset;
+
+  for (allocated = 0; allocated < threads; allocated++) {
+    chunks[allocated] = (struct mappedChunk){ .context = context, .layout = layout,
+                                              .output = { .fd = -1, .records.enabled = OUTPUT->records.enabled } };
+
+    if ((chunks[allocated].overflows = fmt_calloc(OVERFLOW_COUNTERS(layout->count), sizeof(unsigned long))) == NULL  ||
+        openOutputBuffer(&chunks[allocated].output, MAPPED_CHUNK_SIZE, OUTPUT_MODE_MEMORY) != 0) {
+      fmt_free(chunks[allocated].overflows);
+      break;
+    }
+  }
+
+  if (allocated < threads) {
+    for (count = 0; count < allocated; count++) {
+      fmt_free(chunks[count].overflows);
+      fmt_free(chunks[count].output.data);
+    }
+
+    return -2;
+  }
+
+  while (processing_state != -1  &&  reader->position < reader->end) {
+    // Split the rest of mapping
+    for (chunkCount = 0, start = reader->position; chunkCount < threads  &&  start < reader->end; chunkCount++) {
+      chunks[chunkCount].start      = start;
+      chunks[chunkCount].startState = (chunkCount == 0) ? processing_state : 0;
+
+      if ((size_t)(reader->end - start) <= MAPPED_CHUNK_SIZE  ||
+          (eol = memchr(start + MAPPED_CHUNK_SIZE - 1, '\n', reader->end - start - MAPPED_CHUNK_SIZE + 1)) == NULL)
+        chunks[chunkCount].end = reader->end;
+      else
+        chunks[chunkCount].end = eol + 1;
+
+      start = chunks[chunkCount].end;
+    }
+
+    // The first chunk is formatted by the calling thread
+    for (count = 1; count < chunkCount; count++)
+      chunks[count].started = (pthread_create(&chunks[count].thread, NULL, chunk_thread, &chunks[count]) == 0);
+
+    chunk_thread(&chunks[0]);
+
+    for (count = 1; count < chunkCount; count++) {
+      if (chunks[count].started)
+        pthread_join(chunks[count].thread, NULL);
+      else
+        chunk_thread(&chunks[count]);
+    }
+
+    // Merge chunks in the input order
+    offset = output_position(OUTPUT);
+
+    for (merged = 0; merged < chunkCount  &&  processing_state != -1; merged++) {
+      if (chunks[merged].startState != processing_state) {
+        // SQL message crosses the chunk boundary, format chunk once again
+        chunks[merged].startState = processing_state;
+
+        chunk_thread(&chunks[merged]);
+      }
+
+      blocks[merged].iov_base = chunks[merged].output.data;
+      blocks[merged].iov_len  = chunks[merged].output.used;
+
+      move_records(OUTPUT, &chunks[merged].output, offset);
+      offset += chunks[merged].output.used;
+
+      if (overflows != NULL)
+        merge_overflows(layout->count, overflows, chunks[merged].overflows);
+
+      reader->position = chunks[merged].stop;
+      reader->lines   += chunks[merged].lines;
+      reader->bytes   += chunks[merged].bytes;
+      context->stats.rows         += chunks[merged].rows;
+      OUTPUT->filtered            += chunks[merged].output.filtered;
+      context->stats.messageLines += chunks[merged].messageLines;
+
+      processing_state = chunks[merged].endState;
+    }
+
+    outputWritev(OUTPUT, blocks, merged);
+  }
+
+  for (count = 0; count < threads; count++) {
+    fmt_free(chunks[count].overflows);
+    fmt_free(chunks[count].output.data);
+    fmt_free(chunks[count].output.records.items);
+  }
+
+  return processing_state;
+}
+
+
+/*************************************************************
+ * Flush rowset up to the end of rowset
+ * Returns:
+ *  1  - next line is a part of SQL warning/error message 
+ *       in the middle of resultset
+ *  0  - next line is a common rowset row
+ * -1  - rowset processing is completed
+ *************************************************************/
+int process_rowset(struct columnLayout *layout, struct lineReader *reader, int processing_state, unsigned long *overflows, int threads) {
+  char  *line;
+  size_t length;
+  int    result, previous_state;
+
+  if (processing_state == -1)
+    return -1;
+
+  // Mapped rows which are printed as is are copied in runs, it's
+  // faster than formatting them in parallel
+  if (layout->passthrough  &&  reader->map != NULL)
+    threads = 0;
+
+  // Rows of big mapped rowsets format independently, text output
+  // is concatenated in order
+  if ( threads > 0  &&  reader->map != NULL  &&  (size_t)(reader->end - reader->position) >= 2*MAPPED_CHUNK_SIZE  &&
+       OUTPUT->format == OUTPUT_FORMAT_TEXT  &&  !layout->reflow  &&
+       (result = process_mapped_chunks(layout, reader, processing_state, overflows, threads)) != -2 )
+    return result;
+
+  if (threads > 0  &&  (result = process_lines_threaded(layout, NULL, reader, processing_state, overflows, threads)) != -2)
+    return result;
+
+  while (processing_state != -1) {
+    if (processing_state == 0  &&  layout->passthrough  &&  reader->map != NULL)
+      passthrough_rows(layout, reader);
+
+    if ((line = getLine(reader, &length)) == NULL)
+      break;
+
+    previous_state   = processing_state;
+    processing_state = process_row(layout, line, length, processing_state, OUTPUT, overflows);
+    stats_line(previous_state, processing_state);
+  }
+
+  return processing_state;
+}
+
+
+/*************************************************************
+ * Layout cache key: FNV-1a hash of the header lines, projected
+ * columns and filters
+ *************************************************************/
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length) {
+  const unsigned char *bytes = data;
+
+  for (size_t count = 0; count < length; count++)
+    hash = (hash ^ bytes[count])*0x100000001b3ULL;
+
+  return hash;
+}
+
+
+static uint64_t layout_key(const struct processingOptions *options, struct resultsetHeader *header) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  hash = hash_bytes(hash, header->lines[0].data, header->lines[0].length);
+  hash = hash_bytes(hash, "\n", 1);
+  hash = hash_bytes(hash, header->lines[1].data, header->lines[1].length);
+  hash = hash_bytes(hash, "\n", 1);
+
+  if (options->columns != NULL)
+    hash = hash_bytes(hash, options->columns, strlen(options->columns) + 1);
+
+  hash = hash_bytes(hash, &options->utf8, sizeof(options->utf8));
+
+  for (int count = 0; count < options->filterCount; count++) {
+    hash = hash_bytes(hash, options->filters[count].name, options->filters[count].nameLength);
+    hash = hash_bytes(hash, &options->filters[count].operation, sizeof(options->filters[count].operation));
+    hash = hash_bytes(hash, options->filters[count].value, options->filters[count].valueLength + 1);
+  }
+
+  return hash;
+}
+
+
+static struct layoutCacheEntry *find_cached_layout(struct layoutCache *cache, uint64_t key, long count) {
+  for (long entry = 0; entry < cache->count; entry++) {
+    if (cache->entries[entry].key == key  &&  cache->entries[entry].count == count)
+      return &cache->entries[entry];
+  }
+
+  return NULL;
+}
+
+
+static void remove_cached_layout(struct layoutCache *cache, struct layoutCacheEntry *entry) {
+  long index = entry - cache->entries;
+
+  fmt_free(entry->pads);
+  memmove(entry, entry + 1, (cache->count - index - 1)*sizeof(struct layoutCacheEntry));
+  cache->count--;
+  cache->changed = 1;
+}
+
+
+/*************************************************************
+ * Add entry for 'count' columns, the least recently used entry
+ * is dropped when the cache is full. Pads of the entry aren't
+ * initialized.
+ * Returns new entry or NULL on memory allocation error
+ *************************************************************/
+static struct layoutCacheEntry *add_cached_layout(struct layoutCache *cache, uint64_t key, long count) {
+  struct layoutCacheEntry *entry;
+  long *pads;
+
+  if ((pads = fmt_malloc(count*(2*sizeof(long) + 1))) == NULL)
+    return NULL;
+
+  if (cache->count == MAX_LAYOUT_CACHE_ENTRIES)
+    remove_cached_layout(cache, &cache->entries[0]);
+
+  entry = &cache->entries[cache->count++];
+
+  entry->key       = key;
+  entry->count     = count;
+  entry->pads      = pads;
+  entry->justified = (unsigned char *)(pads + 2*count);
+  cache->changed   = 1;
+
+  return entry;
+}
+
+
+void free_layout_cache(struct layoutCache *cache) {
+  for (long entry = 0; entry < cache->count; entry++)
+    fmt_free(cache->entries[entry].pads);
+
+  cache->count = 0;
+}
+
+
+/*************************************************************
+ * Read layout cache file. Missing or damaged file is treated as
+ * an empty cache.
+ *
+ * File is machine local: magic "FMTDB2L1", entry count (8 bytes)
+ * and entries: key (8 bytes), column count (8 bytes), left and
+ * right pads (8 bytes each) and justification flags (1 byte per
+ * column), numbers are in the host byte order.
+ *************************************************************/
+#define LAYOUT_CACHE_MAGIC "FMTDB2L1"
+
+static int read_exactly(int fd, void *data, size_t length) {
+  ssize_t result;
+
+  while (length > 0) {
+    if ((result = read(fd, data, length)) <= 0) {
+      if (result < 0  &&  errno == EINTR)
+        continue;
+
+      return -1;
+    }
+
+    data    = (char *)data + result;
+    length -= result;
+  }
+
+  return 0;
+}
+
+
+void load_layout_cache(struct layoutCache *cache, const char *path) {
+  struct layoutCacheEntry *entry;
+  char     magic[8];
+  uint64_t entries, key;
+  int64_t  count;
+  int      fd;
+
+  cache->loaded = 1;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return;
+
+  if ( read_exactly(fd, magic, 8) != 0  ||  memcmp(magic, LAYOUT_CACHE_MAGIC, 8) != 0  ||
+       read_exactly(fd, &entries, sizeof(entries)) != 0 ) {
+    close(fd);
+    return;
+  }
+
+  while (entries-- > 0  &&  cache->count < MAX_LAYOUT_CACHE_ENTRIES) {
+    if ( read_exactly(fd, &key, sizeof(key)) != 0  ||  read_exactly(fd, &count, sizeof(count)) != 0  ||
+         count <= 0  ||  count > 0x10000 ) {
+      break;
+    }
+
+    if ((entry = add_cached_layout(cache, key, count)) == NULL)
+      break;
+
+    if ( read_exactly(fd, entry->pads, 2*count*sizeof(long)) != 0  ||
+         read_exactly(fd, entry->justified, count) != 0 ) {
+      remove_cached_layout(cache, entry);
+      break;
+    }
+  }
+
+  close(fd);
+  cache->changed = 0;
+}
+
+
+/*************************************************************
+ * Write changed layout cache to the file. Cache is written to
+ * a temporary file which replaces the cache file, so concurrent
+ * runs don't see partially written cache.
+ *************************************************************/
+void save_layout_cache(struct layoutCache *cache, const char *path) {
+  struct outputBuffer file = { .fd = -1 };
+  char     temporary[4096];
+  uint64_t entries = cache->count;
+  int      length;
+
+  if (!cache->changed)
+    return;
+
+  length = snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+
+  if ( length < 0  ||  (size_t)length >= sizeof(temporary)  ||
+       (file.fd = mkstemp(temporary)) < 0  ||
+       openOutputBuffer(&file, INPUT_BLOCK_SIZE, OUTPUT_MODE_BLOCK) != 0 ) {
+    fprintf(stderr, "Can't write layout cache '%s': %s\n", path, strerror(errno));
+
+    if (file.fd >= 0) {
+      close(file.fd);
+      unlink(temporary);
+    }
+    return;
+  }
+
+  outputWrite(&file, LAYOUT_CACHE_MAGIC, 8);
+  outputWrite(&file, (const char *)&entries, sizeof(entries));
+
+  for (long count = 0; count < cache->count; count++) {
+    struct layoutCacheEntry *entry = &cache->entries[count];
+    int64_t columns = entry->count;
+
+    outputWrite(&file, (const char *)&entry->key, sizeof(entry->key));
+    outputWrite(&file, (const char *)&columns, sizeof(columns));
+    outputWrite(&file, (const char *)entry->pads, 2*entry->count*sizeof(long));
+    outputWrite(&file, (const char *)entry->justified, entry->count);
+  }
+
+  closeOutputBuffer(&file);
+
+  if (close(file.fd) != 0  ||  file.error  ||  rename(temporary, path) != 0) {
+    fprintf(stderr, "Can't write layout cache '%s': %s\n", path, strerror(errno));
+    unlink(temporary);
+    return;
+  }
+
+  cache->changed = 0;
+}
+
+
+/*************************************************************
+ * Apply cached pads to the layout analyzed on the first row:
+ * pads are narrowed to fit both. Justification is taken from
+ * the cache through the profile (see is_right_justified()).
+ *************************************************************/
+static void apply_cached_layout(struct columnLayout *layout, const struct layoutCacheEntry *entry) {
+  const long *leftPad = entry->pads, *rightPad = entry->pads + entry->count;
+
+  for (long count = 0; count < layout->count; count++) {
+    if (leftPad[count] != -1  &&  (layout->leftPad[count] == -1  ||  layout->leftPad[count] > leftPad[count]))
+      layout->leftPad[count] = leftPad[count];
+
+    if (rightPad[count] != -1  &&  (layout->rightPad[count] == -1  ||  layout->rightPad[count] > rightPad[count]))
+      layout->rightPad[count] = rightPad[count];
+
+    memset(&layout->profile[count], 0, sizeof(struct columnProfile));
+    layout->profile[count].values       = 1;
+    layout->profile[count].rightAligned = entry->justified[count];
+  }
+}
+
+
+/*************************************************************
+ * Store pads of the formatted rowset. Pads of the columns which
+ * had values wider than the output plan are narrowed to fit
+ * these values, so the next rowset of the header is aligned.
+ *************************************************************/
+static void cache_layout(struct columnLayout *layout, uint64_t key, const unsigned long *overflows) {
+  struct layoutCache *cache = &context->layouts;
+  struct layoutCacheEntry *entry = find_cached_layout(cache, key, layout->count);
+  struct layoutCacheEntry  used;
+  long count;
+
+  for (count = 0; overflows != NULL  &&  count < layout->count; count++) {
+    if (overflows[count] == 0)
+      continue;
+
+    if (layout->leftPad[count] == -1  ||  layout->leftPad[count] > (long)overflows[layout->count + count] - 1)
+      layout->leftPad[count] = overflows[layout->count + count] - 1;
+
+    if (layout->rightPad[count] == -1  ||  layout->rightPad[count] > (long)overflows[2*layout->count + count] - 1)
+      layout->rightPad[count] = overflows[2*layout->count + count] - 1;
+  }
+
+  if (entry != NULL) {
+    // Keep the entry up to date and move it to the end
+    for (count = 0; count < layout->count; count++) {
+      if ( entry->pads[count] != layout->leftPad[count]  ||  entry->pads[layout->count + count] != layout->rightPad[count]  ||
+           entry->justified[count] != is_right_justified(layout, count) )
+        break;
+    }
+
+    if (count == layout->count  &&  entry == &cache->entries[cache->count - 1])
+      return;
+
+    used = *entry;
+    memmove(entry, entry + 1, (&cache->entries[cache->count - 1] - entry)*sizeof(struct layoutCacheEntry));
+    cache->entries[cache->count - 1] = used;
+    entry = &cache->entries[cache->count - 1];
+    cache->changed = 1;
+
+  } else if ((entry = add_cached_layout(cache, key, layout->count)) == NULL) {
+    return;
+  }
+
+  memcpy(entry->pads, layout->leftPad, layout->count*sizeof(long));
+  memcpy(entry->pads + layout->count, layout->rightPad, layout->count*sizeof(long));
+
+  for (count = 0; count < layout->count; count++)
+    entry->justified[count] = is_right_justified(layout, count);
+}
+
+
+/*************************************************************
+ * Row index (--fixed-rows=<file>)
+ *
+ * Text file, one entry per line, offsets are output byte offsets:
+ *
+ *   resultset <number> <header offset> <rows offset> <row length>
+ *   message <row> <offset> <length>
+ *   end <rows> <offset>
+ *
+ * 'message' is a block of SQL message lines printed before row
+ * number <row> (counted from 0) of the resultset, 'end' is the
+ * end of rowset. Row N starts at <rows offset> + N*<row length>
+ * plus lengths of the messages printed before it.
+ *************************************************************/
+static void write_row_index(struct columnLayout *layout, unsigned long long header, unsigned long long rows) {
+  struct outputRecords *records = &OUTPUT->records;
+  unsigned long long    end = output_position(OUTPUT), messages = 0;
+  char   entry[128];
+  size_t count;
+
+  if (!records->enabled)
+    return;
+
+  outputWrite(&context->rowIndex, entry, snprintf(entry, sizeof(entry), "resultset %lu %llu %llu %zu\n",
+                                                  context->stats.resultsets, header, rows, layout->rowLength));
+
+  for (count = 0; count < records->count; count++) {
+    const struct outputRecord *record = &records->items[count];
+
+    if (record->type == RECORD_END) {
+      end = record->offset;
+      break;
+    }
+
+    outputWrite(&context->rowIndex, entry, snprintf(entry, sizeof(entry), "message %llu %llu %zu\n",
+                                                    (record->offset - rows - messages)/layout->rowLength,
+                                                    record->offset, record->length));
+    messages += record->length;
+  }
+
+  outputWrite(&context->rowIndex, entry, snprintf(entry, sizeof(entry), "end %llu %llu\n",
+                                                  (end - rows - messages)/layout->rowLength, end));
+  records->count = 0;
+}
+
+
+/*************************************************************
+ * Create temporary spill file in $TMPDIR (or /tmp)
+ * Returns file descriptor or -1 on error
+ *************************************************************/
+int create_spill_file(void) {
+  char  path[4096];
+  char *directory;
+  int   fd;
+
+  if ((directory = getenv("TMPDIR")) == NULL  ||  directory[0] == 0)
+    directory = "/tmp";
+
+  snprintf(path, sizeof(path), "%s/fmt_db2_output.XXXXXX", directory);
+
+  if ((fd = mkstemp(path)) < 0)
+    return -1;
+
+  // File is removed as soon as it's closed
+  unlink(path);
+
+  return fd;
+}
+
+
+/*************************************************************
+ * Process resultset using whole rowset as a sample without
+ * keeping it in memory. Rows are analyzed while they are read
+ * (pass 1) and are read once again to be printed (pass 2):
+ * seekable input file is rewound to the first row, any other
+ * input is written to a temporary spill file in pass 1.
+ *************************************************************/
+int process_resultset_spilled(const struct processingOptions *options, struct columnLayout *layout, struct resultsetHeader *header) {
+  struct rowsetAnalyzer analyzer;
+  struct outputBuffer spill = { .fd = -1 };
+  struct lineReader   spillReader = { .fd = -1 };
+  struct lineReader  *rows_reader = &spillReader;
+  unsigned long long  headerStart, rowsStart, bytes = 0;
+  unsigned long       lines = 0;
+  off_t  mark;
+  int    reread;
+  char  *line;
+  size_t length;
+  long   rows;
+  int    result;
+  double started;
+
+  if (init_analyzer(&analyzer, layout) != 0) {
+    flushHeader(header);
+    return 4;
+  }
+
+  if ((reread = (markLineReader(INPUT, &mark) == 0))) {
+    // Input statistics count the rows once
+    rows_reader = INPUT;
+    lines       = INPUT->lines;
+    bytes       = INPUT->bytes;
+  } else if ((spill.fd = create_spill_file()) < 0  ||  openOutputBuffer(&spill, SPILL_BUFFER_SIZE, OUTPUT_MODE_BLOCK) != 0) {
+    fprintf(stderr, "Can't create spill file: %s\n", strerror(errno));
+
+    if (spill.fd >= 0)
+      close(spill.fd);
+    free_analyzer(&analyzer);
+    flushHeader(header);
+    return 4;
+  }
+
+
+  // Analyze rowset (pass 1)
+  started = stats_clock();
+
+  for (result = 0, rows = 0; result == 0  &&  (line = getLine(INPUT, &length)) != NULL; rows++) {
+    if (!reread)
+      outputLine(&spill, line, length);
+    result = analyze_row(&analyzer, line, length);
+  }
+
+  free_analyzer(&analyzer);
+  stats_phase(PHASE_ANALYZE_ROWSET, started);
+
+  if (reread) {
+    if (rewindLineReader(INPUT, mark) != 0) {
+      fprintf(stderr, "Input rewind error: %s\n", strerror(errno));
+      flushHeader(header);
+      return 4;
+    }
+
+    INPUT->lines = lines;
+    INPUT->bytes = bytes;
+  } else {
+    closeOutputBuffer(&spill);
+
+    if (spill.error  ||  lseek(spill.fd, 0, SEEK_SET) != 0) {
+      fprintf(stderr, "Spill file write error\n");
+      close(spill.fd);
+      return 4;
+    }
+
+    // Spill file is read in blocks, so memory usage doesn't depend
+    // on the rowset size
+    attachLineReader(&spillReader, spill.fd, 0);
+  }
+
+  if (rows == 0  ||  result == -1) {
+    // No rows or not a DB2 output, print it as is
+    flushHeader(header);
+
+    for (long count = 0; count < rows  &&  (line = getLine(rows_reader, &length)) != NULL; count++)
+      print_line(line, length);
+
+    closeLineReader(&spillReader);
+    return (rows == 0) ? 5 : 8;
+  }
+
+  // Print header
+  started     = stats_clock();
+  headerStart = output_position(OUTPUT);
+  result      = process_header(layout);
+  rowsStart   = output_position(OUTPUT);
+  stats_phase(PHASE_PROCESS_HEADER, started);
+
+  if (result != 0) {
+    closeLineReader(&spillReader);
+    return 4;
+  }
+
+  // Print rowset read once again (pass 2) and the rest of rowset
+  started = stats_clock();
+
+  if (!reread) {
+    result = process_rowset(layout, &spillReader, 0, NULL, options->threads);
+    closeLineReader(&spillReader);
+  }
+
+  process_rowset(layout, INPUT, reread ? 0 : result, NULL, options->threads);
+  stats_phase(PHASE_ROWSET, started);
+
+  write_row_index(layout, headerStart, rowsStart);
+
+  if (options->profile)
+    print_profile(layout);
+  else if (options->layoutCache)
+    cache_layout(layout, layout_key(options, header), NULL);
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Process resultset which starts with the header lines.
+ * Input is read up to the end of rowset.
+ * Returns 0 on success or error code (resultset is printed
+ * as is)
+ *************************************************************/
+int process_resultset(const struct processingOptions *options, struct columnLayout *layout, struct resultsetHeader *header) {
+  struct inputLine *inputLines;
+  struct layoutCacheEntry *cached = NULL;
+  unsigned long *overflows = NULL;
+  uint64_t key = 0;
+  unsigned long long headerStart, rowsStart;
+  long lines;
+  int processing_state, result, sample_size;
+  double started;
+
+  context->stats.resultsets++;
+
+  // Check if correct DB2 output header is presented (min 3 lines)
+  if (header->count < 2) {
+    flushHeader(header);
+    return 5;
+  }
+
+  if (header->lines[1].length != header->lines[0].length) {
+    // It's not a DB2 output
+    flushHeader(header);
+    return 6;
+  }
+
+
+  // Parse column headers
+  started = stats_clock();
+  result  = parse_header(layout, header->lines[0].data, header->lines[1].data, header->lines[1].length);
+  stats_phase(PHASE_PARSE_HEADER, started);
+
+  if (result != 0) {
+    // It's not correct DB2 header
+    flushHeader(header);
+    return 7;
+  }
+
+  if (resolve_filters(layout, options->filters, options->filterCount) != 0) {
+    flushHeader(header);
+    return 4;
+  }
+
+  if (options->columns != NULL  &&  project_columns(layout, options->columns) != 0) {
+    // No columns to print
+    flushHeader(header);
+    return 7;
+  }
+
+  if (build_separators(layout) != 0) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    flushHeader(header);
+    return 4;
+  }
+
+  layout->reflow    = (options->incremental == INCREMENTAL_HEADER);
+  layout->profiling = options->profile;
+  layout->utf8      = options->utf8 ? UTF8_CELLS : 0;
+
+  if (OUTPUT->format != OUTPUT_FORMAT_TEXT) {
+    // Values are trimmed one by one, rowset is streamed without analysis
+    started = stats_clock();
+    result  = process_header(layout);
+    stats_phase(PHASE_PROCESS_HEADER, started);
+
+    if (result != 0) {
+      flushHeader(header);
+      return 4;
+    }
+
+    started = stats_clock();
+    process_rowset(layout, INPUT, 0, NULL, options->threads);
+    stats_phase(PHASE_ROWSET, started);
+
+    return 0;
+  }
+
+  // Cached pads replace the analysis of the sample, the first rows
+  // are checked only. Values which don't fit the cached pads are
+  // printed unaligned and widen the cache entry. Profile needs the
+  // analysis, fixed length rows need exact widths.
+  sample_size = options->sampleSize;
+
+  if (options->layoutCache  &&  !options->profile) {
+    key = layout_key(options, header);
+
+    if ( !options->fixedRows  &&
+         (cached = find_cached_layout(&context->layouts, key, layout->count)) != NULL ) {
+      context->stats.layoutCacheHits++;
+
+      if (sample_size == -1  ||  sample_size > 3)
+        sample_size = 3;
+    }
+  }
+
+  if (options->spill  &&  sample_size == -1) {
+    return process_resultset_spilled(options, layout, header);
+  }
+
+  // Load and analyze rowset (pass 1)
+  inputLines = getInput(layout, header, sample_size, options->threads, &result);
+
+  if (inputLines == NULL) {
+    flushHeader(header);
+    return 4;
+  }
+
+  if (inputLines[2].data == NULL) {
+    flushLines(inputLines);
+    return 5;
+  }
+
+  if (result != 0) {
+    flushLines(inputLines);
+    return 8;
+  }
+
+  if (cached != NULL)
+    apply_cached_layout(layout, cached);
+
+  // Print header. Rows which are not in the sample may have wider values,
+  // they are counted per column.
+  started     = stats_clock();
+  headerStart = output_position(OUTPUT);
+  result      = (sample_size != -1  &&  (overflows = fmt_calloc(OVERFLOW_COUNTERS(layout->count), sizeof(unsigned long))) == NULL)  ||
+                process_header(layout) != 0;
+  rowsStart   = output_position(OUTPUT);
+  stats_phase(PHASE_PROCESS_HEADER, started);
+
+  if (result != 0) {
+    fmt_free(inputLines);
+    releaseLines(INPUT);
+    return 4;
+  }
+
+
+  // Print preloaded rowset. Big mapped rowset is processed in chunks
+  // (see process_mapped_chunks()) from the first row.
+  started = stats_clock();
+
+  for (lines = 2; inputLines[lines].data != NULL; lines++)
+    ;
+
+  if ( options->threads > 0  &&  INPUT->map != NULL  &&  OUTPUT->format == OUTPUT_FORMAT_TEXT  &&  !layout->reflow  &&
+       (size_t)(INPUT->position - inputLines[2].data) >= 2*MAPPED_CHUNK_SIZE ) {
+    unreadLines(INPUT, inputLines[2].data, lines - 2);
+    processing_state = 0;
+  } else {
+    processing_state = process_rowset_preloaded(layout, inputLines, overflows, options->threads);
+  }
+  fmt_free(inputLines);
+  releaseLines(INPUT);
+  stats_phase(PHASE_ROWSET_PRELOADED, started);
+
+  // Process the rest of rowset
+  if (processing_state != -1) {
+    if (overflows != NULL)
+      enable_overflow_check(layout);
+
+    started = stats_clock();
+    process_rowset(layout, INPUT, processing_state, overflows, options->threads);
+    stats_phase(PHASE_ROWSET, started);
+  }
+
+  write_row_index(layout, headerStart, rowsStart);
+
+  if (overflows != NULL)
+    report_overflows(layout, overflows);
+
+  if (options->profile)
+    print_profile(layout);
+  else if (options->layoutCache)
+    cache_layout(layout, key, overflows);
+
+  fmt_free(overflows);
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Process input resultset by resultset. Columns layout and
+ * header buffers are shared by all resultsets.
+ * Returns result of the first resultset processing
+ *************************************************************/
+int process_input(const struct processingOptions *options) {
+  struct columnLayout     layout = { 0 };
+  struct resultsetHeader  header    = { 0 };
+  int result, found;
+  double started;
 
-      printf("%s\n", line);
-      free(line);
+  if (options->layoutCachePath != NULL  &&  !context->layouts.loaded)
+    load_layout_cache(&context->layouts, options->layoutCachePath);
 
-      return state;
+  started = stats_clock();
+  flushIrrelevantLines();
 
-    case 0:
-      if ( (state = is_valid_row(columns, line, state)) == 0 ) {
-        print_row(columns, line);
-      } else {
-        printf("%s\n", line);
-        free(line);
-      }
+  // The first resultset header follows non-relevant lines
+  read_header(INPUT, &header);
+  stats_phase(PHASE_IRRELEVANT_LINES, started);
 
-      return state;
+  result = process_resultset(options, &layout, &header);
 
-    case -1:
-      // Non-resultset lines processing
-      printf("%s\n", line);
-      free(line);
+  // Next resultsets (multi-statement CLP scripts)
+  while (1) {
+    started = stats_clock();
+    found   = find_header(INPUT, &header);
+    stats_phase(PHASE_IRRELEVANT_LINES, started);
 
-      return -1;
+    if (!found)
+      break;
+
+    process_resultset(options, &layout, &header);
   }
+
+  free_header(&header);
+  free_layout(&layout);
+  free_utf8_row();
+
+  // Unknown filter column is a bad argument, rows of the resultset aren't printed
+  if (result == 0  &&  context->stats.unknownFilters != 0)
+    result = 2;
+
+  if (options->layoutCachePath != NULL)
+    save_layout_cache(&context->layouts, options->layoutCachePath);
+
+  return result;
 }
 
+
 /*************************************************************
- * Flush preloaded rowset
- * Returns current state of output processing:
- *  1  - next line is a part of SQL warning/error message 
- *       in the middle of resultset
- *  0  - next line is a common rowset row
- * -1  - rowset processing is completed
+ * Print statistics
+ *
  *************************************************************/
-int process_rowset_preloaded(struct columnDescription *columns, char **lines) {
-  long count;
-  int processing_state = 0;
+void print_stats(void) {
+  static const char *phaseNames[PHASE_COUNT] = {
+    "flushIrrelevantLines", "getInput", "parse_header", "analyze_rowset",
+    "process_header", "process_rowset_preloaded", "process_rowset"
+  };
+  struct rusage usage;
+  double total = 0;
+
+  fprintf(stderr, "Statistics:\n");
+
+  for (int phase = 0; phase < PHASE_COUNT; phase++) {
+    fprintf(stderr, "  %-26s %12.6f s\n", phaseNames[phase], context->stats.phaseTime[phase]);
+    total += context->stats.phaseTime[phase];
+  }
+  fprintf(stderr, "  %-26s %12.6f s\n", "total", total);
+
+  fprintf(stderr, "  %-26s %12lu\n",  "resultsets", context->stats.resultsets);
+  fprintf(stderr, "  %-26s %12llu\n", "bytes read", INPUT->bytes);
+  fprintf(stderr, "  %-26s %12lu\n",  "lines read", INPUT->lines);
+  fprintf(stderr, "  %-26s %12lu\n",  "rows formatted", context->stats.rows - OUTPUT->filtered);
+  fprintf(stderr, "  %-26s %12lu\n",  "rows filtered out", OUTPUT->filtered);
+  fprintf(stderr, "  %-26s %12lu\n",  "SQL message lines", context->stats.messageLines);
+  fprintf(stderr, "  %-26s %12lu\n",  "layout cache hits", context->stats.layoutCacheHits);
+  fprintf(stderr, "  %-26s %12lu\n",  "input buffer growths", INPUT->growths);
+
+  if (context->stats.batches != 0)
+    fprintf(stderr, "  %-26s %12lu (%.1f lines each)\n", "formatter batches", context->stats.batches,
+            (double)context->stats.batchLines/context->stats.batches);
+
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    fprintf(stderr, "  %-26s %12ld KB\n", "peak memory", usage.ru_maxrss);
+}
 
-  // Iterate through lines
-  for (count = 2; lines[count] != NULL; count++) {
-    processing_state = process_row(columns, lines[count], processing_state);
+
+void print_usage(void) {
+  printf("Usage: format_db2_output [options] [sample_size] [file]\n");
+  printf("  format_db2_output takes data from the standard input (or <file>) and prints it to standard output\n");
+  printf("  <sample_size> is a number of rows taken to produce output format\n");
+  printf("  if <sample_size> is ommitted, then whole row set is used to prepare format\n");
+  printf("  <file> is read through memory mapping if it's a regular file, '-' means standard input\n");
+  printf("  values of rows out of the sample which are wider than computed format are printed unaligned\n");
+  printf("  and reported to standard error\n");
+  printf("Options:\n");
+  printf("  --format=<format>            output format: text (default), csv, tsv, jsonl or columnar. csv, tsv and\n");
+  printf("                               jsonl print trimmed values one row per line, other lines go to standard\n");
+  printf("                               error. 'columnar' is a binary stream of column names and record\n");
+  printf("                               batches of trimmed values, see fmt_db2_output.c\n");
+  printf("  --null=<string>              csv and tsv field of NULL value (empty by default), jsonl prints null\n");
+  printf("  --incremental[=<policy>]     print rows as they arrive. Column widths are taken from the first row\n");
+  printf("                               (or the sample), values wider than that are handled by <policy>:\n");
+  printf("                               'header' (default) widens the column and prints header once again,\n");
+  printf("                               'unaligned' prints the value unaligned\n");
+  printf("  --columns=<name>,...         print only listed columns in the listed order (names are case\n");
+  printf("                               insensitive). Other columns aren't analyzed or checked\n");
+  printf("  --where=<column><op><value>  print only rows matching the filter, filters may be repeated (all of\n");
+  printf("                               them have to match). <op> is one of '=', '!=', '^=' (prefix), '<',\n");
+  printf("                               '<=', '>' and '>=' (numeric compare). Filtered out rows don't affect\n");
+  printf("                               column widths. A filter of column missing in the resultset matches\n");
+  printf("                               no rows and the return code is 2\n");
+  printf("  --utf8                       input is UTF-8 with columns padded by display width. Rows are checked\n");
+  printf("                               for non-ASCII bytes, only such rows are decoded\n");
+  printf("  --layout-cache[=<file>]      reuse column widths computed for the same header (and --columns,\n");
+  printf("                               --where and --utf8) by the previous resultsets or runs, only the\n");
+  printf("                               first 3 rows are analyzed instead of the <sample_size>. Cache is\n");
+  printf("                               kept in <file> if it's given. Values which don't fit the cached\n");
+  printf("                               widths are printed unaligned, the cached widths are widened for them\n");
+  printf("  --fixed-rows[=<index>]       all rows of text output have the length of the header line, widths\n");
+  printf("                               are computed from the whole rowset (<sample_size> and --incremental\n");
+  printf("                               are ignored). <index> file lists output offsets of the resultsets,\n");
+  printf("                               their rows and SQL messages inside of them, see fmt_db2_output.c\n");
+#ifdef FMTDB2_ZLIB
+  printf("  --compress=gzip[:<level>]    compress output with gzip, <level> is 0-9. gzip input is detected\n");
+  printf("                               and decompressed by default\n");
+#endif
+#ifdef FMTDB2_URING
+  printf("  --io=uring|sync              read input and write output through io_uring with several reads\n");
+  printf("                               and writes in flight, input file isn't mapped. Default is sync\n");
+#endif
+  printf("  --stats                      print per phase timings and counters to standard error at exit\n");
+  printf("  --profile                    print profile of each column values to standard error: value, empty,\n");
+  printf("                               NULL and numeric counts, trimmed length range and distribution\n");
+  printf("                               (text format, analyzed rows only)\n");
+  printf("  --spill                      don't keep whole rowset sample in memory: seekable input file is read\n");
+  printf("                               twice, other input is kept in a temporary file ($TMPDIR or /tmp)\n");
+  printf("  --threads=<n>                format rows in <n> threads in parallel with reading and writing\n");
+  printf("                               (text rowsets of mapped <file> are split into chunks formatted in\n");
+  printf("                               parallel)\n");
+  printf("  --out-buffer=<size>          output buffer size, K/M/G suffixes are allowed (default 1M)\n");
+  printf("  --out-mode=auto|line|block   write output at the end of each line or when the buffer is full\n");
+  printf("                               (default 'auto': line mode for terminals, block mode otherwise)\n");
+}
+
+
+/*************************************************************
+ * Parse size argument like '4096', '64K' or '4M'
+ * Returns 0 on success, -1 on wrong format
+ *************************************************************/
+int parse_size(const char *value, size_t *size) {
+  char *end;
+  unsigned long long result;
+
+  errno  = 0;
+  result = strtoull(value, &end, 10);
+
+  if (errno != 0  ||  end == value)
+    return -1;
+
+  switch (*end) {
+    case 'g': case 'G': result *= 1024;  // fall through
+    case 'm': case 'M': result *= 1024;  // fall through
+    case 'k': case 'K': result *= 1024;
+      end++;
   }
 
-  return processing_state;
+  if (*end != 0  ||  result == 0)
+    return -1;
+
+  *size = result;
+  return 0;
 }
 
 
 /*************************************************************
- * Flush rowset
- * Returns:
- *  1  - next line is a part of SQL warning/error message 
- *       in the middle of resultset
- *  0  - next line is a common rowset row
- * -1  - rowset processing is completed
+ * Parse row filter like 'COL=value', 'COL^=prefix' or 'COL>=10'
+ * Returns 0 on success, -1 on wrong format
  *************************************************************/
-int process_rowset(struct columnDescription *columns, int processing_state) {
-  char *line;
+int parse_filter(const char *expression, struct rowFilter *filter) {
+  const char *position = strpbrk(expression, "=!^<>");
+  char *end;
+
+  if (position == NULL  ||  position == expression)
+    return -1;
+
+  filter->name       = expression;
+  filter->nameLength = position - expression;
+
+  if (position[0] == '!'  &&  position[1] == '=') {
+    filter->operation = FILTER_NOT_EQUAL;
+    position += 2;
+  } else if (position[0] == '^'  &&  position[1] == '=') {
+    filter->operation = FILTER_PREFIX;
+    position += 2;
+  } else if (position[0] == '<'  &&  position[1] == '=') {
+    filter->operation = FILTER_LESS_EQUAL;
+    position += 2;
+  } else if (position[0] == '>'  &&  position[1] == '=') {
+    filter->operation = FILTER_GREATER_EQUAL;
+    position += 2;
+  } else if (position[0] == '<') {
+    filter->operation = FILTER_LESS;
+    position++;
+  } else if (position[0] == '>') {
+    filter->operation = FILTER_GREATER;
+    position++;
+  } else if (position[0] == '=') {
+    filter->operation = FILTER_EQUAL;
+    position++;
+  } else {
+    return -1;
+  }
+
+  filter->value       = position;
+  filter->valueLength = strlen(position);
 
-  while ( (line = getLine(INPUT)) != NULL ) {
-    processing_state = process_row(columns, line, processing_state);
+  if (filter->operation >= FILTER_LESS) {
+    errno = 0;
+    filter->number = strtod(position, &end);
+
+    if (errno != 0  ||  end == position  ||  *end != 0)
+      return -1;
   }
 
-  return processing_state;
+  return 0;
 }
 
 
-int process_input(int sample_size) {
-  char  **inputLines;
-  size_t  headerLength;
-  struct columnDescription  *columnsContainer;
+/*************************************************************
+ * Parse tool options. 'file_name' is NULL for the library, file
+ * name isn't allowed then. Filters are stored to 'filters'
+ * (one per option at most), options keep pointers to the
+ * arguments.
+ * Returns 0 on success or exit code: 1 - help is requested,
+ * 2 - wrong argument, 3 - wrong number of arguments
+ *************************************************************/
+int parse_arguments(int count, char *const *arguments, struct processingOptions *options, struct rowFilter *filters,
+                    const char **file_name) {
+  int sample_size_given = 0;
+
+  *options = (struct processingOptions){ .sampleSize = -1, .outBufferSize = DEFAULT_OUTPUT_BUFFER_SIZE };
+
+  for (int argn = 0; argn < count; argn++) {
+    if (strcmp(arguments[argn], "--help") == 0 || strcmp(arguments[argn], "-help") == 0 || strcmp(arguments[argn], "-h") == 0) {
+      return 1;
+    } else if (strncmp(arguments[argn], "--out-buffer=", 13) == 0  &&  parse_size(arguments[argn] + 13, &options->outBufferSize) == 0) {
+      continue;
+    } else if (strncmp(arguments[argn], "--threads=", 10) == 0  &&  sscanf(arguments[argn] + 10, "%d", &options->threads) == 1  &&
+               options->threads >= 0  &&  options->threads <= MAX_THREADS) {
+      continue;
+    } else if (strcmp(arguments[argn], "--spill") == 0) {
+      options->spill = 1;
+    } else if (strcmp(arguments[argn], "--stats") == 0) {
+      options->stats = 1;
+    } else if (strcmp(arguments[argn], "--layout-cache") == 0) {
+      options->layoutCache = 1;
+    } else if (strncmp(arguments[argn], "--layout-cache=", 15) == 0  &&  arguments[argn][15] != 0) {
+      options->layoutCache     = 1;
+      options->layoutCachePath = arguments[argn] + 15;
+    } else if (strcmp(arguments[argn], "--fixed-rows") == 0) {
+      options->fixedRows = 1;
+    } else if (strncmp(arguments[argn], "--fixed-rows=", 13) == 0  &&  arguments[argn][13] != 0) {
+      options->fixedRows    = 1;
+      options->rowIndexPath = arguments[argn] + 13;
+#ifdef FMTDB2_ZLIB
+    } else if (strcmp(arguments[argn], "--compress=gzip") == 0) {
+      options->compress      = 1;
+      options->compressLevel = Z_DEFAULT_COMPRESSION;
+    } else if (strncmp(arguments[argn], "--compress=gzip:", 16) == 0  &&  sscanf(arguments[argn] + 16, "%d", &options->compressLevel) == 1  &&
+               options->compressLevel >= 0  &&  options->compressLevel <= 9) {
+      options->compress = 1;
+#endif
+#ifdef FMTDB2_URING
+    } else if (strcmp(arguments[argn], "--io=uring") == 0) {
+      options->uring = 1;
+#endif
+    } else if (strcmp(arguments[argn], "--io=sync") == 0) {
+      options->uring = 0;
+    } else if (strcmp(arguments[argn], "--profile") == 0) {
+      options->profile = 1;
+    } else if (strcmp(arguments[argn], "--utf8") == 0) {
+      options->utf8 = 1;
+    } else if (strncmp(arguments[argn], "--columns=", 10) == 0  &&  arguments[argn][10] != 0) {
+      options->columns = arguments[argn] + 10;
+    } else if (strncmp(arguments[argn], "--where=", 8) == 0  &&  parse_filter(arguments[argn] + 8, &filters[options->filterCount]) == 0) {
+      options->filters = filters;
+      options->filterCount++;
+    } else if (strcmp(arguments[argn], "--incremental") == 0  ||  strcmp(arguments[argn], "--incremental=header") == 0) {
+      options->incremental = INCREMENTAL_HEADER;
+    } else if (strcmp(arguments[argn], "--incremental=unaligned") == 0) {
+      options->incremental = INCREMENTAL_UNALIGNED;
+    } else if (strcmp(arguments[argn], "--format=text") == 0) {
+      options->format = OUTPUT_FORMAT_TEXT;
+    } else if (strcmp(arguments[argn], "--format=columnar") == 0) {
+      options->format = OUTPUT_FORMAT_COLUMNAR;
+    } else if (strcmp(arguments[argn], "--format=csv") == 0) {
+      options->format = OUTPUT_FORMAT_CSV;
+    } else if (strcmp(arguments[argn], "--format=tsv") == 0) {
+      options->format = OUTPUT_FORMAT_TSV;
+    } else if (strcmp(arguments[argn], "--format=jsonl") == 0) {
+      options->format = OUTPUT_FORMAT_JSONL;
+    } else if (strncmp(arguments[argn], "--null=", 7) == 0) {
+      options->nullValue = arguments[argn] + 7;
+    } else if (strcmp(arguments[argn], "--out-mode=auto") == 0) {
+      options->outMode = OUTPUT_MODE_AUTO;
+    } else if (strcmp(arguments[argn], "--out-mode=line") == 0) {
+      options->outMode = OUTPUT_MODE_LINE;
+    } else if (strcmp(arguments[argn], "--out-mode=block") == 0) {
+      options->outMode = OUTPUT_MODE_BLOCK;
+    } else if (!sample_size_given  &&  sscanf(arguments[argn], "%d", &options->sampleSize) == 1) {
+      sample_size_given = 1;
+    } else if ((arguments[argn][0] == '-'  &&  arguments[argn][1] != 0)  ||  file_name == NULL) {
+      fprintf(stderr, "Wrong argument '%s'.\n\n", arguments[argn]);
+
+      return 2;
+    } else if (*file_name == NULL) {
+      *file_name = arguments[argn];
+    } else {
+      fprintf(stderr, "Wrong number of arguments.\n\n");
 
+      return 3;
+    }
+  }
 
-  flushIrrelevantLines();
+  if (options->fixedRows  &&  (options->format != OUTPUT_FORMAT_TEXT  ||  options->utf8)) {
+    fprintf(stderr, "--fixed-rows is supported for text output without --utf8 only.\n\n");
 
-  if ((inputLines = getInput(sample_size)) == NULL) {
+    return 2;
+  }
+
+  // Fixed rows need the widths of all values, no value may be
+  // wider than the output plan
+  if (options->fixedRows) {
+    options->sampleSize  = -1;
+    options->incremental = INCREMENTAL_OFF;
+  }
+
+  if (options->incremental != INCREMENTAL_OFF) {
+    // Output plan is taken from the first row, rows are written as soon
+    // as they are formatted
+    if (!sample_size_given)
+      options->sampleSize = 3;
+
+    if (options->outMode == OUTPUT_MODE_AUTO)
+      options->outMode = OUTPUT_MODE_LINE;
+
+    // Header reflow changes output plan, rows are formatted one by one
+    if (options->incremental == INCREMENTAL_HEADER)
+      options->threads = 0;
+  }
+
+  return 0;
+}
+
+
+/*************************************************************
+ * Open output buffers and row index file of the context
+ * Returns 0 on success or exit code: 2 - row index file can't
+ * be opened, 4 - memory allocation error
+ *************************************************************/
+static int open_output(void) {
+  const struct processingOptions *options = &context->options;
+
+  context->rowIndex.fd = -1;
+
+  if ( options->rowIndexPath != NULL  &&
+       (context->rowIndex.fd = open(options->rowIndexPath, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 ) {
+    fprintf(stderr, "Can't open row index file '%s': %s\n", options->rowIndexPath, strerror(errno));
+    return 2;
+  }
+
+  if (openOutputBuffer(OUTPUT, options->outBufferSize, options->outMode) != 0) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
     return 4;
   }
 
-  // Check if correct DB2 output header is presented (min 3 lines
-  if (inputLines[0] == NULL  ||  inputLines[1] == NULL  ||  inputLines[2] == NULL) {
-    flushLines(inputLines);
-    return 5;
+#ifdef FMTDB2_URING
+  // Compressed output is written by io_uring too
+  if ( options->uring  &&  OUTPUT->sink == NULL  &&
+       (context->uringOutput = openUringOutput(OUTPUT)) == NULL )
+    fprintf(stderr, "io_uring can't be used for output, it's written with write(2)\n");
+#endif
+
+#ifdef FMTDB2_ZLIB
+  if (options->compress  &&  (context->compressor = openGzipOutput(OUTPUT, options->compressLevel)) == NULL) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return 4;
   }
+#endif
 
-  headerLength = strlen(inputLines[0]);
-  if (strlen(inputLines[1]) != headerLength) {
-    // It's not a DB2 output
-    flushLines(inputLines);
-    return 6;
+  if ( (options->format == OUTPUT_FORMAT_COLUMNAR  &&  openColumnarOutput(OUTPUT, 0) != 0)  ||
+       (options->format >= OUTPUT_FORMAT_CSV  &&  openOutputBuffer(&context->messages, INPUT_BLOCK_SIZE, OUTPUT_MODE_LINE) != 0)  ||
+       (context->rowIndex.fd >= 0  &&  openOutputBuffer(&context->rowIndex, INPUT_BLOCK_SIZE, OUTPUT_MODE_BLOCK) != 0) ) {
+    fprintf(stderr, "Not enough memory or memory allocation error\n");
+    return 4;
   }
 
+  OUTPUT->records.enabled = (context->rowIndex.fd >= 0);
 
-  // Parse column headers
-  if ((columnsContainer = parse_header(inputLines[0], inputLines[1])) == NULL) {
-    // It's not correct DB2 header
-    flushLines(inputLines);
-    return 7;
+  OUTPUT->format = options->format;
+
+  if (options->format == OUTPUT_FORMAT_COLUMNAR)
+    outputWrite(OUTPUT, COLUMNAR_MAGIC, 8);
+  else if (options->format != OUTPUT_FORMAT_TEXT)
+    OUTPUT->messages = &context->messages;
+
+  return 0;
+}
+
+
+static void close_output(void) {
+  closeColumnarOutput(OUTPUT, 1);
+  closeOutputBuffer(OUTPUT);
+  closeOutputBuffer(&context->messages);
+
+#ifdef FMTDB2_ZLIB
+  if (context->compressor != NULL) {
+    if (closeGzipOutput(context->compressor) != 0)
+      OUTPUT->error = 1;
+    context->compressor = NULL;
   }
+#endif
 
-  // Analaze rowset (pass 1)
-  if (analyze_rowset(columnsContainer, inputLines) != 0) {
-    free(columnsContainer);
-    flushLines(inputLines);
-    return 8;
+#ifdef FMTDB2_URING
+  if (context->uringOutput != NULL) {
+    if (closeUringOutput(context->uringOutput) != 0)
+      OUTPUT->error = 1;
+    context->uringOutput = NULL;
   }
+#endif
 
-  // Print header
-  process_header(columnsContainer);
-  free(inputLines[0]);
-  free(inputLines[1]);
+  if (context->rowIndex.fd >= 0) {
+    closeOutputBuffer(&context->rowIndex);
+
+    if (close(context->rowIndex.fd) != 0  ||  context->rowIndex.error)
+      fprintf(stderr, "Row index file write error\n");
+    context->rowIndex.fd = -1;
+  }
+}
+
+
+/*************************************************************
+ * Library push interface (see fmtdb2.h)
+ *
+ * The formatter reads its input, so each context has a worker
+ * thread which runs process_input() over the fed chunks. The
+ * worker reads input with read_chunk(): it takes data of the
+ * current chunk and waits for the next one when the chunk is
+ * consumed, fmtdb2_feed() returns at that moment.
+ * fmtdb2_reset() ends the input and waits for the worker.
+ *************************************************************/
+static ssize_t read_chunk(void *data, char *buffer, size_t size) {
+  struct formatterContext *processed = data;
+  size_t length;
+
+  pthread_mutex_lock(&processed->mutex);
+
+  while (processed->chunkLength == 0  &&  !processed->finished) {
+    processed->waiting = 1;
+    pthread_cond_broadcast(&processed->cond);
+    pthread_cond_wait(&processed->cond, &processed->mutex);
+  }
+
+  length = (processed->chunkLength < size) ? processed->chunkLength : size;
+  memcpy(buffer, processed->chunk, length);
+  processed->chunk       += length;
+  processed->chunkLength -= length;
+
+  pthread_mutex_unlock(&processed->mutex);
+
+  return length;
+}
+
+
+static void *push_worker(void *argument) {
+  struct formatterContext *processed = argument;
+
+  enter_context(processed);
+
+  if ((processed->result = open_output()) == 0) {
+#ifdef FMTDB2_ZLIB
+    if (openGzipInput(INPUT) != 0)
+      processed->result = 4;
+    else
+#endif
+      processed->result = process_input(&processed->options);
+  }
+
+  close_output();
 
+  if (processed->options.stats)
+    print_stats();
+  closeLineReader(INPUT);
 
-  int processing_state;
+  pthread_mutex_lock(&processed->mutex);
+  processed->done = 1;
+  pthread_cond_broadcast(&processed->cond);
+  pthread_mutex_unlock(&processed->mutex);
 
-  // Print preloaded rowset
-  processing_state = process_rowset_preloaded(columnsContainer, inputLines);
-  free(inputLines);
+  return NULL;
+}
+
+
+/*************************************************************
+ * Start worker for the new input
+ * Returns 0 on success, -1 if thread can't be started
+ *************************************************************/
+static int start_worker(struct formatterContext *processed) {
+  processed->input    = (struct lineReader){ .fd = -1, .source = read_chunk, .sourceData = processed };
+  processed->output   = (struct outputBuffer){ .fd = -1, .sink = processed->write, .sinkData = processed->opaque,
+                                               .stream = FMTDB2_OUTPUT };
+  processed->messages = (struct outputBuffer){ .fd = -1, .sink = processed->write, .sinkData = processed->opaque,
+                                               .stream = FMTDB2_MESSAGES };
+  processed->rowIndex = (struct outputBuffer){ .fd = -1 };
+
+  memset(&processed->stats, 0, sizeof(processed->stats));
 
-  // Process the rest of input
-  processing_state = process_rowset(columnsContainer, processing_state);
+  processed->chunk       = NULL;
+  processed->chunkLength = 0;
+  processed->waiting     = 0;
+  processed->finished    = 0;
+  processed->done        = 0;
 
-  free(columnsContainer);
+  if (pthread_create(&processed->worker, NULL, push_worker, processed) != 0)
+    return -1;
+
+  processed->started = 1;
 
   return 0;
 }
 
-void print_usage(void) {
-  printf("Usage: format_db2_output [sample_size]\n");
-  printf("  format_db2_output takes data from the standard input and prints it to standard output\n");
-  printf("  <sample_size> is a number of rows taken to produce output format\n");
-  printf("  if <sample_size> is ommitted, then whole row set is used to prepare format\n");
+
+FMTDB2_API fmtdb2_context *fmtdb2_create(int count, const char *const *options, const struct fmtdb2_allocator *allocation,
+                                         fmtdb2_write write, void *opaque) {
+  struct formatterContext *created;
+
+  if (allocation == NULL)
+    allocation = &defaultAllocator;
+
+  if ((created = allocation->allocate(allocation->opaque, sizeof(struct formatterContext))) == NULL)
+    return NULL;
+
+  memset(created, 0, sizeof(struct formatterContext));
+
+  created->allocator = *allocation;
+  created->write     = write;
+  created->opaque    = opaque;
+
+  if ( (count > 0  &&  (created->filters = allocation->allocate(allocation->opaque, count*sizeof(struct rowFilter))) == NULL)  ||
+       parse_arguments(count, (char *const *)options, &created->options, created->filters, NULL) != 0 ) {
+    if (created->filters != NULL)
+      allocation->release(allocation->opaque, created->filters);
+    allocation->release(allocation->opaque, created);
+
+    return NULL;
+  }
+
+  pthread_mutex_init(&created->mutex, NULL);
+  pthread_cond_init(&created->cond, NULL);
+
+  return created;
 }
 
-int main(int argc, char *argv[]) {
-  int sample_size = -1;
 
-  if (argc == 1) {
-    sample_size = -1;
-  } else if (argc == 2 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-help") == 0 || strcmp(argv[1], "-h") == 0)) {
-    print_usage();
+FMTDB2_API int fmtdb2_feed(fmtdb2_context *processed, const char *data, size_t length) {
+  int result;
 
-    return 1;
-  } else if (argc == 2 && sscanf(argv[1], "%d", &sample_size) != 1) {
-    fprintf(stderr, "Wrong argument '%s'.\n\n", argv[1]);
+  if (!processed->started  &&  start_worker(processed) != 0)
+    return -1;
+
+  pthread_mutex_lock(&processed->mutex);
+
+  processed->chunk       = data;
+  processed->chunkLength = length;
+  processed->waiting     = 0;
+  pthread_cond_broadcast(&processed->cond);
+
+  while (!processed->done  &&  !(processed->waiting  &&  processed->chunkLength == 0))
+    pthread_cond_wait(&processed->cond, &processed->mutex);
+
+  // Worker which is done doesn't read input any more
+  result = (processed->done  ||  processed->output.error) ? -1 : 0;
+  processed->chunk       = NULL;
+  processed->chunkLength = 0;
+
+  pthread_mutex_unlock(&processed->mutex);
+
+  return result;
+}
 
+
+FMTDB2_API int fmtdb2_reset(fmtdb2_context *processed) {
+  if (!processed->started  &&  start_worker(processed) != 0)
+    return 4;
+
+  pthread_mutex_lock(&processed->mutex);
+  processed->finished = 1;
+  pthread_cond_broadcast(&processed->cond);
+  pthread_mutex_unlock(&processed->mutex);
+
+  pthread_join(processed->worker, NULL);
+  processed->started = 0;
+
+  return processed->result;
+}
+
+
+FMTDB2_API void fmtdb2_destroy(fmtdb2_context *processed) {
+  struct fmtdb2_allocator allocation = processed->allocator;
+
+  if (processed->started)
+    fmtdb2_reset(processed);
+
+  enter_context(processed);
+  free_layout_cache(&processed->layouts);
+  context   = NULL;
+  allocator = &defaultAllocator;
+
+  pthread_cond_destroy(&processed->cond);
+  pthread_mutex_destroy(&processed->mutex);
+
+  if (processed->filters != NULL)
+    allocation.release(allocation.opaque, processed->filters);
+  allocation.release(allocation.opaque, processed);
+}
+
+
+#ifndef FMTDB2_LIBRARY
+
+int main(int argc, char *argv[]) {
+  struct formatterContext tool = {
+    .input     = { .fd = STDIN_FILENO },
+    .output    = { .fd = STDOUT_FILENO },
+    .messages  = { .fd = STDERR_FILENO },
+    .allocator = defaultAllocator
+  };
+  struct rowFilter filters[argc];
+  const char *file_name = NULL;
+  int result;
+
+  enter_context(&tool);
+
+  if ((result = parse_arguments(argc - 1, argv + 1, &context->options, filters, &file_name)) != 0) {
     print_usage();
 
+    return result;
+  }
+
+  if (file_name != NULL  &&  strcmp(file_name, "-") != 0  &&  openLineReader(INPUT, file_name, !context->options.uring) != 0) {
+    fprintf(stderr, "Can't open input file '%s': %s\n", file_name, strerror(errno));
+
     return 2;
-  } else if (argc > 2){
-    fprintf(stderr, "Wrong number of arguments.\n\n", argv[1]);
-    print_usage();
+  }
+
+#ifdef FMTDB2_URING
+  if (context->options.uring  &&  openUringInput(INPUT) != 0)
+    fprintf(stderr, "io_uring can't be used for input, it's read with read(2)\n");
+#endif
+
+#ifdef FMTDB2_ZLIB
+  if (openGzipInput(INPUT) != 0) {
+    closeLineReader(INPUT);
 
-    return 3;
+    return 4;
   }
+#endif
 
-  return process_input(sample_size);
-}
+  if ((result = open_output()) != 0) {
+    close_output();
+    closeLineReader(INPUT);
+
+    return result;
+  }
 
+  result = process_input(&context->options);
+
+  close_output();
+
+  if (context->options.stats)
+    print_stats();
+  closeLineReader(INPUT);
+  free_layout_cache(&context->layouts);
+
+  return result;
+}
 
+#endif
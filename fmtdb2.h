@@ -0,0 +1,91 @@
+/*
+  DB2 CLP output formatting library (libfmtdb2)
+
+  Push interface of the formatter for embedding: DB2 CLP output
+  is fed in chunks of any size, formatted output is returned
+  through the write callback.
+
+  Build: cc -O2 -pthread -fPIC -shared -fvisibility=hidden -DFMTDB2_LIBRARY -o libfmtdb2.so fmt_db2_output.c
+*/
+
+#ifndef FMTDB2_H
+#define FMTDB2_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define FMTDB2_API __attribute__((visibility("default")))
+#else
+#define FMTDB2_API
+#endif
+
+/*************************************************************
+ * Memory allocator. All memory of the context (including the
+ * context itself) is allocated with it. 'release' isn't called
+ * with NULL pointer. With --threads the functions are called
+ * from the worker threads concurrently.
+ *************************************************************/
+struct fmtdb2_allocator {
+  void *(*allocate)(void *opaque, size_t size);
+  void *(*reallocate)(void *opaque, void *pointer, size_t size);
+  void  (*release)(void *opaque, void *pointer);
+  void  *opaque;
+};
+
+// Streams of the write callback
+#define FMTDB2_OUTPUT   1   // Formatted output
+#define FMTDB2_MESSAGES 2   // Non-resultset lines of csv, tsv and jsonl formats (standard error of the tool)
+
+/*************************************************************
+ * Write callback. Returns 0 on success, any other value stops
+ * the output up to fmtdb2_reset().
+ *************************************************************/
+typedef int (*fmtdb2_write)(void *opaque, int stream, const char *data, size_t length);
+
+typedef struct formatterContext fmtdb2_context;
+
+/*************************************************************
+ * Create formatter context
+ * 'options' are the tool options (see --help) without program
+ * name, file name is not allowed. Option strings have to be
+ * valid up to fmtdb2_destroy(). 'allocator' may be NULL for
+ * malloc(3).
+ * Returns NULL on wrong options or memory allocation error
+ *************************************************************/
+FMTDB2_API fmtdb2_context *fmtdb2_create(int count, const char *const *options, const struct fmtdb2_allocator *allocator,
+                                         fmtdb2_write write, void *opaque);
+
+/*************************************************************
+ * Feed chunk of DB2 CLP output. Returns when the chunk is
+ * consumed and formatted as far as possible: a sample or the
+ * rest of line may wait for the next chunks. Output is written
+ * when the output buffer is full (see --out-mode) and by
+ * fmtdb2_reset(). With --threads output may be written by the
+ * writer thread after return, calls of the callback for one
+ * context are never concurrent.
+ * Returns 0 on success, -1 on error
+ *************************************************************/
+FMTDB2_API int fmtdb2_feed(fmtdb2_context *context, const char *data, size_t length);
+
+/*************************************************************
+ * End of input: format the rest of input, write all output and
+ * prepare the context for the next DB2 CLP output.
+ * Returns result of the formatting (exit code of the tool)
+ *************************************************************/
+FMTDB2_API int fmtdb2_reset(fmtdb2_context *context);
+
+/*************************************************************
+ * Free context. Input which isn't reset is formatted as by
+ * fmtdb2_reset() first.
+ *************************************************************/
+FMTDB2_API void fmtdb2_destroy(fmtdb2_context *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif